@@ -0,0 +1,135 @@
+/*
+ * Emulator for the external log device, for the host build. The device is an image file of
+ * FRAM_SIZE bytes mapped into memory, read and written through the same calls as fram.c. A new
+ * image starts out holding junk, as a new part would. Writes are counted.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "config.h"
+#include "fram.h"
+#include "framhost.h"
+
+static uint8_t *_image;                 // Where the device image is mapped
+static int _fd=-1;
+
+static uint32_t _writes;
+static uint32_t _bytesWritten;
+
+// ============================================================================================
+// ============================================================================================
+// ============================================================================================
+// Externally available routines
+// ============================================================================================
+// ============================================================================================
+// ============================================================================================
+BOOL framRead(uint32_t addr, void *data, uint32_t len)
+
+// Read len bytes from addr in the device
+
+{
+    if ((!_image) || (addr+len>FRAM_SIZE)) return FALSE;
+
+    memcpy(data, _image+addr, len);
+    return TRUE;
+}
+// ============================================================================================
+BOOL framWrite(uint32_t addr, const void *data, uint32_t len)
+
+// Write len bytes to addr in the device
+
+{
+    if ((!_image) || (addr+len>FRAM_SIZE)) return FALSE;
+
+    memcpy(_image+addr, data, len);
+    _writes++;
+    _bytesWritten+=len;
+    return TRUE;
+}
+// ============================================================================================
+BOOL framWait(void)
+
+// The image is always ready
+
+{
+    return (_image!=NULL);
+}
+// ============================================================================================
+BOOL framInit(void)
+
+// Check the device is there
+
+{
+    return (_image!=NULL);
+}
+// ============================================================================================
+BOOL framHostOpen(const char *imageFile)
+
+// Map the device image, creating it full of junk if it doesn't exist yet
+
+{
+    struct stat st;
+    uint32_t i=0;
+
+    if ((_fd=open(imageFile, O_RDWR|O_CREAT, 0644))<0)
+        return FALSE;
+
+    if ((fstat(_fd, &st)) || (st.st_size!=FRAM_SIZE))
+        {
+            if (ftruncate(_fd, FRAM_SIZE))
+                {
+                    close(_fd);
+                    return FALSE;
+                }
+            st.st_size=0;
+        }
+
+    _image=mmap(NULL, FRAM_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, _fd, 0);
+    if (_image==MAP_FAILED)
+        {
+            _image=NULL;
+            close(_fd);
+            return FALSE;
+        }
+
+    if (!st.st_size)
+        {
+            while (i<FRAM_SIZE) _image[i++]=rand();
+        }
+
+    _writes=0;
+    _bytesWritten=0;
+    return TRUE;
+}
+// ============================================================================================
+void framHostClose(void)
+
+// Unmap the image, leaving it on disk for next time
+
+{
+    munmap(_image, FRAM_SIZE);
+    _image=NULL;
+    close(_fd);
+}
+// ============================================================================================
+uint32_t framHostWrites(void)
+
+// Return the number of write transfers
+
+{
+    return _writes;
+}
+// ============================================================================================
+uint32_t framHostBytesWritten(void)
+
+// Return the number of bytes written
+
+{
+    return _bytesWritten;
+}
+// ============================================================================================
@@ -0,0 +1,18 @@
+/*
+ * Host build support. An emulator for the I2C FRAM or EEPROM the log can be kept in, backed by an
+ * image file, standing in for fram.c so nvfram.c can be run off target. Only built with
+ * HOST_BUILD and LOG_STORE_FRAM defined; see nvhost.c.
+ */
+
+#ifndef FRAMHOST_H_
+#define FRAMHOST_H_
+
+#include "config.h"
+
+// ============================================================================================
+BOOL framHostOpen(const char *imageFile);                   // Map the image, creating it if needed
+void framHostClose(void);                                   // Unmap the image
+uint32_t framHostWrites(void);                              // Number of write transfers
+uint32_t framHostBytesWritten(void);                        // Number of bytes written
+// ============================================================================================
+#endif /* FRAMHOST_H_ */
@@ -0,0 +1,90 @@
+/*
+ * Stand-ins for the parts of the system that nv.c and log.c lean on, for the host build. There
+ * are no brownouts, and timers only mature when iapHostTimersExpire is called.
+ */
+
+#include <time.h>
+#include "config.h"
+#include "timers.h"
+#include "bod.h"
+#include "nv.h"
+#include "iaphost.h"
+
+#define HOST_MAX_TIMERS 8
+
+uint32_t SystemCoreClock=12000000;
+
+static timerType *_running[HOST_MAX_TIMERS];
+
+// ============================================================================================
+BOOL bodIsActive(void)
+
+{
+    return FALSE;
+}
+// ============================================================================================
+void timerInit(timerType *t)
+
+{
+    t->origin=TIMER_ORIGIN_ILLEGAL;
+}
+// ============================================================================================
+void timerAdd(timerType *newTimer, timerOriginType origin, uint32_t numberSet, uint32_t timeoutSet)
+
+{
+    uint32_t i=0;
+
+    newTimer->origin=origin;
+    newTimer->number=numberSet;
+    newTimer->timeout=timeoutSet;
+    while ((i<HOST_MAX_TIMERS) && (_running[i]) && (_running[i]!=newTimer)) i++;
+    ASSERT(i<HOST_MAX_TIMERS);
+    _running[i]=newTimer;
+}
+// ============================================================================================
+void timerDel(timerType *t)
+
+{
+    t->origin=TIMER_ORIGIN_ILLEGAL;
+}
+// ============================================================================================
+BOOL timerRunning(timerType *t)
+
+{
+    return t->origin!=TIMER_ORIGIN_ILLEGAL;
+}
+// ============================================================================================
+uint32_t timerMicros(void)
+
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000000+ts.tv_nsec/1000;
+}
+// ============================================================================================
+void iapHostTimersExpire(void)
+
+// Mature every running timer now, passing those for the nv store on to it
+
+{
+    uint32_t i=0;
+    timerType *t;
+
+    while (i<HOST_MAX_TIMERS)
+        {
+            if ((t=_running[i]))
+                {
+                    _running[i]=0;
+                    if (t->origin==TIMER_ORIGIN_NV)
+                        {
+                            t->origin=TIMER_ORIGIN_ILLEGAL;
+                            nvTimeout(t->number);
+                        }
+                    else
+                        t->origin=TIMER_ORIGIN_ILLEGAL;
+                }
+            i++;
+        }
+}
+// ============================================================================================
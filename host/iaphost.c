@@ -0,0 +1,221 @@
+/*
+ * Emulator for the LPC8xx IAP flash calls, for the host build. The flash is a 16KB image file
+ * mapped into memory. It's programmed and erased by the same rules as the real part; sectors
+ * must be prepared first, programs are whole aligned blocks that can only clear bits, and erases
+ * are by page or sector. Each program and erase is counted against the pages it touched.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "config.h"
+#include "iaphost.h"
+
+#define IAP_HOST_PART_ID     0x00008122                     // LPC812M101JDH20
+#define IAP_HOST_BOOT_VER    0x00000D01
+
+// IAP status codes
+#define CMD_SUCCESS          0
+#define INVALID_COMMAND      1
+#define SRC_ADDR_ERROR       2
+#define DST_ADDR_ERROR       3
+#define DST_ADDR_NOT_MAPPED  5
+#define COUNT_ERROR          6
+#define INVALID_SECTOR       7
+#define SECTOR_NOT_PREPARED  9
+#define PARAM_ERROR          12
+
+uint8_t *iapHostFlash;                  // Where the flash image is mapped
+static int _fd=-1;
+
+static BOOL _prepared;                  // Sectors prepared for the next program or erase...
+static uint32_t _prepStart;             // ...from here
+static uint32_t _prepEnd;               // ...to here, inclusive
+
+static uint32_t _programs[IAP_HOST_PAGES];
+static uint32_t _erases[IAP_HOST_PAGES];
+static uint32_t _overwrites;
+
+// ============================================================================================
+BOOL _isPrepared(uint32_t start, uint32_t len)
+
+// Check the flash from start for len bytes sits in the prepared sectors. Either way the
+// preparation is used up, as it is on the real part.
+
+{
+    BOOL retVal=(_prepared) && (start/IAP_HOST_SECTOR_LEN>=_prepStart)
+                && ((start+len-1)/IAP_HOST_SECTOR_LEN<=_prepEnd);
+
+    _prepared=FALSE;
+    return retVal;
+}
+// ============================================================================================
+uint32_t _program(uint32_t dst, const uint32_t *src, uint32_t len)
+
+// Copy RAM to flash. Flash bits can only be cleared by programming.
+
+{
+    uint32_t *d=(uint32_t *)(iapHostFlash+dst);
+    uint32_t page=dst/IAP_HOST_PAGE_LEN;
+    uint32_t i=0;
+
+    if (dst&(IAP_HOST_PAGE_LEN-1)) return DST_ADDR_ERROR;
+    if ((uintptr_t)src&(sizeof(uint32_t)-1)) return SRC_ADDR_ERROR;
+    if ((len!=64) && (len!=128) && (len!=256) && (len!=512) && (len!=1024)) return COUNT_ERROR;
+    if (dst+len>IAP_HOST_FLASH_LEN) return DST_ADDR_NOT_MAPPED;
+    if (!_isPrepared(dst, len)) return SECTOR_NOT_PREPARED;
+
+    while (i<len/sizeof(uint32_t))
+        {
+            if (src[i]&~d[i]) _overwrites++;
+            d[i]&=src[i];
+            i++;
+        }
+
+    while (page<(dst+len)/IAP_HOST_PAGE_LEN) _programs[page++]++;
+    return CMD_SUCCESS;
+}
+// ============================================================================================
+uint32_t _erase(uint32_t first, uint32_t last, uint32_t len)
+
+// Erase from first to last, inclusive, in units of len bytes
+
+{
+    uint32_t page;
+
+    if ((first>last) || ((last+1)*len>IAP_HOST_FLASH_LEN))
+        return (len==IAP_HOST_SECTOR_LEN)?INVALID_SECTOR:PARAM_ERROR;
+    if (!_isPrepared(first*len, (last-first+1)*len)) return SECTOR_NOT_PREPARED;
+
+    memset(iapHostFlash+first*len, 0xFF, (last-first+1)*len);
+    page=first*len/IAP_HOST_PAGE_LEN;
+    while (page<(last+1)*len/IAP_HOST_PAGE_LEN) _erases[page++]++;
+    return CMD_SUCCESS;
+}
+// ============================================================================================
+// ============================================================================================
+// ============================================================================================
+// Externally available routines
+// ============================================================================================
+// ============================================================================================
+// ============================================================================================
+void iapHostEntry(unsigned long command[], unsigned long result[])
+
+// Carry out an IAP command on the image
+
+{
+    switch (command[0])
+        {
+            case 50: // Prepare sectors
+                if ((command[1]>command[2]) || (command[2]>=IAP_HOST_SECTORS))
+                    {
+                        result[0]=INVALID_SECTOR;
+                        break;
+                    }
+                _prepared=TRUE;
+                _prepStart=command[1];
+                _prepEnd=command[2];
+                result[0]=CMD_SUCCESS;
+                break;
+
+            case 51: // Copy RAM to flash
+                result[0]=_program(command[1], (const uint32_t *)command[2], command[3]);
+                break;
+
+            case 52: // Erase sectors
+                result[0]=_erase(command[1], command[2], IAP_HOST_SECTOR_LEN);
+                break;
+
+            case 59: // Erase pages
+                result[0]=_erase(command[1], command[2], IAP_HOST_PAGE_LEN);
+                break;
+
+            case 54: // Read part ID
+                result[0]=CMD_SUCCESS;
+                result[1]=IAP_HOST_PART_ID;
+                break;
+
+            case 55: // Read boot code version
+                result[0]=CMD_SUCCESS;
+                result[1]=IAP_HOST_BOOT_VER;
+                break;
+
+            default:
+                result[0]=INVALID_COMMAND;
+                break;
+        }
+}
+// ============================================================================================
+BOOL iapHostOpen(const char *imageFile)
+
+// Map the flash image, creating it fully erased if it doesn't exist yet
+
+{
+    struct stat st;
+
+    if ((_fd=open(imageFile, O_RDWR|O_CREAT, 0644))<0)
+        return FALSE;
+
+    if ((fstat(_fd, &st)) || (st.st_size!=IAP_HOST_FLASH_LEN))
+        {
+            if (ftruncate(_fd, IAP_HOST_FLASH_LEN))
+                {
+                    close(_fd);
+                    return FALSE;
+                }
+            st.st_size=0;
+        }
+
+    iapHostFlash=mmap(NULL, IAP_HOST_FLASH_LEN, PROT_READ|PROT_WRITE, MAP_SHARED, _fd, 0);
+    if (iapHostFlash==MAP_FAILED)
+        {
+            close(_fd);
+            return FALSE;
+        }
+
+    if (!st.st_size) memset(iapHostFlash, 0xFF, IAP_HOST_FLASH_LEN);
+
+    memset(_programs, 0, sizeof(_programs));
+    memset(_erases, 0, sizeof(_erases));
+    _overwrites=0;
+    _prepared=FALSE;
+    return TRUE;
+}
+// ============================================================================================
+void iapHostClose(void)
+
+// Unmap the image, leaving it on disk for next time
+
+{
+    munmap(iapHostFlash, IAP_HOST_FLASH_LEN);
+    close(_fd);
+}
+// ============================================================================================
+uint32_t iapHostPagePrograms(uint32_t page)
+
+// Return the number of times a page was programmed
+
+{
+    return (page<IAP_HOST_PAGES)?_programs[page]:0;
+}
+// ============================================================================================
+uint32_t iapHostPageErases(uint32_t page)
+
+// Return the number of times a page was erased
+
+{
+    return (page<IAP_HOST_PAGES)?_erases[page]:0;
+}
+// ============================================================================================
+uint32_t iapHostOverwrites(void)
+
+// Return the number of programs that tried to set bits that were already clear. The real part
+// ANDs the data in just like we do, so these are bugs.
+
+{
+    return _overwrites;
+}
+// ============================================================================================
@@ -0,0 +1,35 @@
+/*
+ * Host build support. An emulator for the LPC8xx IAP flash calls, backed by an image file, plus
+ * stand-ins for the rest of the system that nv.c and log.c lean on, so they can be run and
+ * measured off target. Only built with HOST_BUILD defined; see nvhost.c.
+ */
+
+#ifndef IAPHOST_H_
+#define IAPHOST_H_
+
+#include "config.h"
+
+#define IAP_HOST_FLASH_LEN   0x4000                             // 16KB part
+#define IAP_HOST_PAGE_LEN    64
+#define IAP_HOST_SECTOR_LEN  1024
+#define IAP_HOST_PAGES       (IAP_HOST_FLASH_LEN/IAP_HOST_PAGE_LEN)
+#define IAP_HOST_SECTORS     (IAP_HOST_FLASH_LEN/IAP_HOST_SECTOR_LEN)
+
+// There's no program in the image, so pretend one fills the bottom of flash
+#ifndef NV_STORE_START
+#define NV_STORE_START       0x2000
+#endif
+
+extern uint8_t *iapHostFlash;           // Where the flash image is mapped
+
+// ============================================================================================
+void iapHostEntry(unsigned long command[], unsigned long result[]); // Stands in for iap_entry
+BOOL iapHostOpen(const char *imageFile);                    // Map the image, creating it erased if needed
+void iapHostClose(void);                                    // Unmap the image
+uint32_t iapHostPagePrograms(uint32_t page);                // Number of times a page was programmed
+uint32_t iapHostPageErases(uint32_t page);                  // Number of times a page was erased
+uint32_t iapHostOverwrites(void);                           // Programs that tried to turn a 0 into a 1
+
+void iapHostTimersExpire(void);                             // Mature every running timer now
+// ============================================================================================
+#endif /* IAPHOST_H_ */
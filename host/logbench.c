@@ -0,0 +1,260 @@
+/*
+ * Host benchmark for the log packer and decoder. Writes streams of records through log.c, reads
+ * them back, and checks they come back unaltered, including after some of the words have been
+ * damaged. Reports the time taken per record and the space used. The store is replaced by a
+ * buffer, so only the packing and unpacking are measured.
+ *
+ * Build from the top of the tree with something like;
+ *
+ *   gcc -std=gnu99 -O2 -DHOST_BUILD -Iinc -Isrc -Ihost -o logbench host/logbench.c \
+ *       src/log.c src/dutils.c
+ *
+ * and run as 'logbench [records]'.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "config.h"
+#include "nv.h"
+#include "log.h"
+
+#define DEFAULT_RECORDS  1000000
+
+static const uint32_t _lengths[]= { 12, 7, 22, 8, 1 };   // Matching LOG_BITS
+static const uint32_t _scales[]= { DEGREE/10, 1, 1, DEGREE, 1 };
+
+static uint32_t *_words;                // Words committed by log.c
+static uint32_t _numWords;
+
+static uint32_t *_vars;                 // Records written...
+static uint32_t *_vals;
+static uint32_t *_logs;                 // ...and the log each went into
+static uint32_t _numRecords;
+
+// ============================================================================================
+// Stand-ins for the store
+// ============================================================================================
+BOOL nvInit(void)
+{
+    return TRUE;
+}
+BOOL nvWrite_entry(uint32_t val_to_write)
+{
+    _words[_numWords++]=val_to_write;
+    return TRUE;
+}
+BOOL nvMakeRoom(void)
+{
+    return TRUE;
+}
+BOOL nvAppend(uint32_t val_to_write)
+{
+    return nvWrite_entry(val_to_write);
+}
+BOOL nvSync(void)
+{
+    return TRUE;
+}
+BOOL nvFlush(void)
+{
+    return TRUE;
+}
+uint32_t nvTotalSpace(void)
+{
+    return 0xFFFFFFFF;
+}
+uint32_t nvSpaceAfter(nvIterator *n)
+{
+    return 0xFFFFFFFF;
+}
+void nvInitIterator(nvIterator *n)
+{
+    n->rp=_words;
+    n->state=NV_OK;
+}
+void nvInitIteratorEnd(nvIterator *n)
+{
+    n->state=NV_ENDSTATE;
+}
+uint32_t nvIteratorNext(nvIterator *n)
+{
+    if ((n->state!=NV_OK) || (n->rp==_words+_numWords) || (*n->rp==NV_EMPTY))
+        {
+            n->state=NV_ENDSTATE;
+            return NV_EMPTY;
+        }
+    return *n->rp++;
+}
+uint32_t nvIteratorPrev(nvIterator *n)
+{
+    return NV_EMPTY;
+}
+nvState nvIteratorState(nvIterator *n)
+{
+    return n->state;
+}
+// ============================================================================================
+static void _expect(uint32_t variable, uint32_t value)
+
+// Note a record that's to be logged, and what should come back from it
+
+{
+    _vars[_numRecords]=variable;
+    _vals[_numRecords]=value/_scales[variable];
+    if (_vals[_numRecords]>(1<<_lengths[variable])-1) _vals[_numRecords]=(1<<_lengths[variable])-1;
+    _logs[_numRecords++]=logNumLogs();
+}
+// ============================================================================================
+static BOOL _check(const char *what, BOOL allowLoss)
+
+// Read the log back and compare it with what was written. Records can be lost to damage if
+// that's allowed, but they must otherwise come back in order and unaltered.
+
+{
+    logIterator l;
+    uint32_t i=0, decoded=0;
+
+    logInitIterator(&l);
+    while (logIteratorNext(&l))
+        {
+            if (logIsCarried(&l)) continue;
+            while ((allowLoss) && (i<_numRecords) && ((_logs[i]!=l.currentLog)
+                    || (_vars[i]!=l.variable) || (_vals[i]!=l.value))) i++;
+            if ((i==_numRecords) || (_logs[i]!=l.currentLog) || (_vars[i]!=l.variable) || (_vals[i]!=l.value))
+                {
+                    printf("%s: record %d differs\n", what, i);
+                    return FALSE;
+                }
+            i++;
+            decoded++;
+        }
+
+    if ((!allowLoss) && (decoded!=_numRecords))
+        {
+            printf("%s: %d of %d records read back\n", what, decoded, _numRecords);
+            return FALSE;
+        }
+    printf("%s: %d of %d records read back, %d damaged words skipped\n", what, decoded, _numRecords,
+           logBadWords(&l));
+    return TRUE;
+}
+// ============================================================================================
+static uint64_t _now(void)
+
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec*1000000000+t.tv_nsec;
+}
+// ============================================================================================
+int main(int argc, char **argv)
+
+{
+    uint32_t records=(argc>1)?atoi(argv[1]):DEFAULT_RECORDS;
+    uint32_t temp=250*DEGREE;
+    uint32_t i, v;
+    uint64_t t;
+    logIterator l;
+    BOOL good;
+
+    _words=malloc((2*records+64)*sizeof(uint32_t));
+    _vars=malloc(records*sizeof(uint32_t));
+    _vals=malloc(records*sizeof(uint32_t));
+    _logs=malloc(records*sizeof(uint32_t));
+
+    // A mix of all the record types, broken into sessions
+    while (_numRecords<records)
+        {
+            v=rand()%(sizeof(_lengths)/sizeof(_lengths[0]));
+            _vals[_numRecords]=((rand()&3)?rand():0xFFFF)%((1<<_lengths[v])*_scales[v]);
+
+            // Keep intervals short enough that checkpoints don't swamp the figures
+            if (v==LOG_RECORD_INTERVAL) _vals[_numRecords]%=128*mS;
+            _vars[_numRecords++]=v;
+        }
+
+    _numWords=0;
+    logNewLog();
+    t=_now();
+    i=0;
+    while (i<records)
+        {
+            _logs[i]=logNumLogs();
+            logWrite(_vars[i], _vals[i]);
+            if (!(++i%5000)) logNewLog();
+        }
+    logNewLog();
+    t=_now()-t;
+
+    i=0;
+    while (i<records)
+        {
+            _vals[i]/=_scales[_vars[i]];
+            if (_vals[i]>(1<<_lengths[_vars[i]])-1) _vals[i]=(1<<_lengths[_vars[i]])-1;
+            i++;
+        }
+    printf("Packing: %.1f nS/record, %.2f bits/record\n", (double)t/records, (double)_numWords*32/records);
+
+    t=_now();
+    logInitIterator(&l);
+    while (logIteratorNext(&l));
+    t=_now()-t;
+    printf("Unpacking: %.1f nS/record\n", (double)t/records);
+    good=_check("Mixed records", FALSE);
+
+    // Damage one data word in a thousand. Only what's in them, and changes in temperature up to
+    // the next full value, should be lost.
+    i=1;
+    while (i<_numWords)
+        {
+            if ((!(rand()%1000)) && (!(_words[i]&0x80000000)) && (!(_words[i-1]&0x80000000)))
+                _words[i]=0x80000000|(rand()&0x7FFFFFF0);
+            i++;
+        }
+    good&=_check("Damaged", TRUE);
+
+    // Reflow-like temperatures, with the odd jump, go as changes and must come back unaltered
+    _numWords=_numRecords=0;
+    logNewLog();
+    _expect(LOG_RECORD_INTERVAL, mS);
+    logWrite(LOG_RECORD_INTERVAL, mS);
+    while (_numRecords<records)
+        {
+            if (!(rand()%1000))
+                temp=rand()%(500*DEGREE);
+            else if ((_numRecords%600)<150)
+                temp+=rand()%20;
+            else if ((_numRecords%600)<450)
+                temp+=(rand()%5)-2;
+            else if (temp>50)
+                temp-=rand()%15;
+            _expect(LOG_TEMPERATURE, temp);
+            logWrite(LOG_TEMPERATURE, temp);
+            if (!(rand()%5000)) logNewLog();
+        }
+    logNewLog();
+    good&=_check("Temperatures", FALSE);
+    printf("Temperatures: %.2f bits each against %d for the full value\n",
+           (double)_numWords*32/records, LOG_ELEMENT_BITS+_lengths[LOG_TEMPERATURE]);
+
+    // A long hold, where the temperature only moves now and again, goes as runs of repeats
+    _numWords=_numRecords=0;
+    logNewLog();
+    _expect(LOG_RECORD_INTERVAL, 20*mS);
+    logWrite(LOG_RECORD_INTERVAL, 20*mS);
+    while (_numRecords<records)
+        {
+            if (!(rand()%50))
+                temp+=(rand()%3)-1;
+            _expect(LOG_TEMPERATURE, temp);
+            logWrite(LOG_TEMPERATURE, temp);
+        }
+    logNewLog();
+    good&=_check("Hold", FALSE);
+    printf("Hold: %.2f bits each\n", (double)_numWords*32/records);
+    return !good;
+}
+// ============================================================================================
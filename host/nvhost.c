@@ -0,0 +1,175 @@
+/*
+ * Host driver for the log and config stores. Runs a reflow-like logging load and a series of
+ * config commits against a flash image through the IAP emulator, then reports the flash traffic
+ * and the wear on each page. The logs are listed from the summaries written as each one closes.
+ * The image is kept, so runs can be chained to look at reboots.
+ *
+ * Build from the top of the tree with something like;
+ *
+ *   gcc -std=gnu99 -DHOST_BUILD -Wno-pointer-to-int-cast -Wno-int-to-pointer-cast \
+ *       -Iinc -Isrc -Ihost -o nvhost host/nvhost.c host/iaphost.c host/hostenv.c \
+ *       src/nv.c src/log.c src/dutils.c
+ *
+ * and run as 'nvhost <image> [sessions] [samples per session] [config commits]'.
+ *
+ * To keep the log in an external FRAM instead, with the device emulated by framhost.c, build with
+ *
+ *   gcc -std=gnu99 -DHOST_BUILD -DLOG_STORE_FRAM -Wno-pointer-to-int-cast -Wno-int-to-pointer-cast \
+ *       -Iinc -Isrc -Ihost -o nvhost host/nvhost.c host/iaphost.c host/framhost.c host/hostenv.c \
+ *       src/nv.c src/nvfram.c src/log.c src/dutils.c
+ *
+ * The config is still kept in the flash image, and the device image goes alongside it in
+ * <image>.fram.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "config.h"
+#include "nv.h"
+#include "log.h"
+#include "iaphost.h"
+#ifdef LOG_STORE_FRAM
+#include "framhost.h"
+#endif
+
+#define DEFAULT_SESSIONS  20
+#define DEFAULT_SAMPLES   600
+#define DEFAULT_CONFIGS   10
+
+// ============================================================================================
+static void _runSession(uint32_t samples)
+
+// Log one run; a ramp up to reflow temperature and back, with the odd setpoint change.
+// Flash work is done between samples, as the main loop would.
+
+{
+    uint32_t i=0;
+    uint32_t temp=250;
+
+    logNewLog();
+    logWrite(LOG_RECORD_INTERVAL, mS);
+    logWrite(LOG_SETPOINT_SET, 150*DEGREE);
+    while (i<samples)
+        {
+            temp=(i<samples/2)?temp+(rand()%5):((temp>250)?temp-(rand()%5):temp);
+            logWrite(LOG_TEMPERATURE, temp);
+            if (!(i%50)) logWrite(LOG_ON_PERCENTAGE, rand()%100);
+            if (i==samples/3) logWrite(LOG_SETPOINT_SET, 220*DEGREE);
+            nvRunJob();
+            i++;
+        }
+
+    // Let the idle timer go off and get everything into flash
+    iapHostTimersExpire();
+    nvDrain();
+}
+// ============================================================================================
+static void _runConfigs(uint32_t commits)
+
+// Commit the config a number of times, letting the stale slot erase happen between each
+
+{
+    ConfigStoreType c;
+    uint32_t i=0;
+
+    if (!nvReadConfig(&c)) memset(&c, 0, sizeof(c));
+    while (i<commits)
+        {
+            c.setPoint=i;
+            if (!nvWriteConfig(&c, NULL)) printf("Config commit %d failed\n", i);
+            nvDrain();
+            iapHostTimersExpire();
+            nvDrain();
+            i++;
+        }
+}
+// ============================================================================================
+static uint32_t _countRecords(uint32_t *sessions)
+
+// List the logs from their summaries, returning how many records and sessions the store holds
+
+{
+    logIterator l;
+    logSummaryType s;
+    uint32_t records=0;
+
+    *sessions=0;
+    logInitIterator(&l);
+    while (logNextSummary(&l, &s))
+        {
+            printf("Log %4d: %5d records over %6ds, %d-%d°C\n", s.logNum, s.entries, s.duration,
+                   s.minTemp/DEGREE, s.maxTemp/DEGREE);
+            records+=s.entries;
+            (*sessions)++;
+        }
+    printf("\n");
+    return records;
+}
+// ============================================================================================
+int main(int argc, char **argv)
+
+{
+    uint32_t sessions=(argc>2)?atoi(argv[2]):DEFAULT_SESSIONS;
+    uint32_t samples=(argc>3)?atoi(argv[3]):DEFAULT_SAMPLES;
+    uint32_t configs=(argc>4)?atoi(argv[4]):DEFAULT_CONFIGS;
+    uint32_t page=0, maxErase=0, maxProgram=0, records, logs;
+    nvStatsType s;
+#ifdef LOG_STORE_FRAM
+    char framImage[FILENAME_MAX];
+#endif
+
+    if (argc<2)
+        {
+            printf("Usage: %s <image> [sessions] [samples per session] [config commits]\n", argv[0]);
+            return 1;
+        }
+
+    if (!iapHostOpen(argv[1]))
+        {
+            printf("Couldn't open flash image %s\n", argv[1]);
+            return 1;
+        }
+
+#ifdef LOG_STORE_FRAM
+    snprintf(framImage, sizeof(framImage), "%s.fram", argv[1]);
+    if (!framHostOpen(framImage))
+        {
+            printf("Couldn't open device image %s\n", framImage);
+            return 1;
+        }
+#endif
+
+    logInit();
+    while (sessions--) _runSession(samples);
+    _runConfigs(configs);
+    records=_countRecords(&logs);
+
+    nvGetStats(&s);
+    printf("Log holds %d records in %d sessions, %d of %d bytes free\n", records, logs,
+           nvGetSpace(), nvTotalSpace());
+    printf("Words %d, programs %d, erases %d, seek reads %d, worst jobs (uS) %d/%d/%d\n",
+           s.entries, s.programs, s.erases, s.seekReads,
+           s.jobMax[NV_JOB_PROGRAM], s.jobMax[NV_JOB_ERASE], s.jobMax[NV_JOB_CONFIG]);
+
+    printf("\nPage  Address  Programs  Erases\n");
+    while (page<IAP_HOST_PAGES)
+        {
+            if ((iapHostPagePrograms(page)) || (iapHostPageErases(page)))
+                printf("%4d   0x%04x  %8d  %6d\n", page, page*IAP_HOST_PAGE_LEN,
+                       iapHostPagePrograms(page), iapHostPageErases(page));
+            if (iapHostPagePrograms(page)>maxProgram) maxProgram=iapHostPagePrograms(page);
+            if (iapHostPageErases(page)>maxErase) maxErase=iapHostPageErases(page);
+            page++;
+        }
+    printf("\nMost programmed page %d times, most erased %d times, %d bad overwrites\n",
+           maxProgram, maxErase, iapHostOverwrites());
+
+#ifdef LOG_STORE_FRAM
+    printf("Device writes %d, %d bytes\n", framHostWrites(), framHostBytesWritten());
+    framHostClose();
+#endif
+    iapHostClose();
+    return (iapHostOverwrites()!=0);
+}
+// ============================================================================================
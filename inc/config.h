@@ -16,7 +16,7 @@
 
 // ----- Version numbering
 // -----------------------
-#define LEATER_VERSION_NUMBER   0x14011501
+#define LEATER_VERSION_NUMBER   0x14011505
 #define LEATER_VERSION          "1.00, 15th Jan 2014"
 
 // ----- Type of temperature sensor
@@ -24,6 +24,12 @@
 //#define SENSOR_THERMISTOR   1
 #define SENSOR_THERMOCOUPLE 2
 
+// ----- Where the log is kept
+// ---------------------------
+// By default the log lives in whatever flash the program leaves spare. Define this to keep it
+// in an I2C FRAM or EEPROM instead, which holds far more and never needs erasing.
+//#define LOG_STORE_FRAM      1
+
 // ----- UART Baudrate
 // -------------------
 #define UART_BAUDRATE           115200
@@ -76,13 +82,13 @@ typedef uint32_t BOOL;
     .version=LEATER_VERSION_NUMBER, \
     .logOutputCSV=TRUE,             \
     .setPoint=13*DEGREE,            \
-    .recordInterval=20,             \
+    .recordInterval=20*mS,          \
     .k=3,                           \
     .Cp=10,                         \
     .Ci=400,                        \
     .Cd=30000,                      \
-    .profile={LEATER_PROFILES},     \
-    .defaultProfile=SETPOINT_STATIC
+    .defaultProfile=SETPOINT_STATIC, \
+    .logEvery=LOG_SELECT_DEFAULT
 
 /*
  * Note that k is the scaling constant for the low pass filter. Checkout
@@ -99,6 +105,10 @@ typedef uint32_t BOOL;
  * 8:       0.0007              561
  */
 
+// Control cycle (mS). A reading is taken and the PID run once each, so it's also the shortest
+// record interval.
+#define CYCLE_LEN       1000
+
 // Log Configuration data
 // ----------------------
 // How many elment bits to use (keep low to improve log density)
@@ -110,12 +120,85 @@ typedef uint32_t BOOL;
 #define LOG_RECORD_INTERVAL        2
 #define LOG_SETPOINT_SET           3
 #define LOG_BOD_TRIGGERED          4
+#define LOG_TEMPERATURE_DELTA      5        // Written in place of LOG_TEMPERATURE, length is variable
+#define LOG_PID_TRACE              6        // A block of PID iterations from the recorder
+#define LOG_TEMPERATURE_MIN        7        // Lowest and highest readings averaged into the next
+#define LOG_TEMPERATURE_MAX        8        // temperature
+#define LOG_SCHEMA                 9        // Describes the variables in a log, at its start
+#define LOG_ON_PERCENTAGE_MIN      10       // Lowest and highest outputs averaged into the next
+#define LOG_ON_PERCENTAGE_MAX      11       // temperature
+#define LOG_TEMPERATURE_SPREAD     12       // Standard deviations of the readings and outputs
+#define LOG_ON_PERCENTAGE_SPREAD   13       // averaged into the next temperature
+#define LOG_TEMPERATURE_REPEAT     14       // Run of temperatures the same as the last, length is the count
+
+// Units of the variables, referred to by number here and in the logs
+#define LOG_UNITS        "", "°C", "%%", "s", "BOOL", "mS"
+#define LOG_UNIT_NONE              0
+#define LOG_UNIT_DEGREES           1
+#define LOG_UNIT_PERCENT           2
+#define LOG_UNIT_SECONDS           3
+#define LOG_UNIT_BOOL              4
+#define LOG_UNIT_MILLISECONDS      5
+
+#define LOG_BITS         {12, DEGREE/10, LOG_UNIT_DEGREES, "Temperature"}, \
+    {7, 1     , LOG_UNIT_PERCENT, "On Percentage"},    \
+    {22, 1    , LOG_UNIT_MILLISECONDS, "Record Interval"},   \
+    {8, DEGREE, LOG_UNIT_DEGREES, "Setpoint"},            \
+    {1, 1     , LOG_UNIT_BOOL, "BOD Triggered"},    \
+    {0, DEGREE/10, LOG_UNIT_DEGREES, "Temperature Change"}, \
+    {0, 1     , LOG_UNIT_NONE, "PID Trace"}, \
+    {12, DEGREE/10, LOG_UNIT_DEGREES, "Lowest Temperature"}, \
+    {12, DEGREE/10, LOG_UNIT_DEGREES, "Highest Temperature"}, \
+    {0, 1     , LOG_UNIT_NONE, "Schema"}, \
+    {7, 1     , LOG_UNIT_PERCENT, "Lowest On Percentage"}, \
+    {7, 1     , LOG_UNIT_PERCENT, "Highest On Percentage"}, \
+    {8, DEGREE/10, LOG_UNIT_DEGREES, "Temperature Spread"}, \
+    {7, 1     , LOG_UNIT_PERCENT, "On Percentage Spread"}, \
+    {6, 1     , LOG_UNIT_NONE, "Temperature Repeat"}
+
+// Which variables are logged, one in every how many of them, with 0 to leave one out. There's
+// room for an entry for every variable number; see logCanSelect for those that can't be changed.
+// The range of the output and the spreads are left out unless they're asked for.
+#define LOG_MAX_VARIABLES          ((1<<LOG_ELEMENT_BITS)-1)
+#define LOG_SELECT_DEFAULT         {1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 1}
+
+// Temperatures are logged as the change from the last one, with the full value written at the
+// start of each log, when the change is too big, and at least this often
+#define LOG_KEYFRAME_INTERVAL      32
 
-#define LOG_BITS         {12, DEGREE/10, "°C", "Temperature"}, \
-    {7, 1     , "%%", "On Percentage"},    \
-    {7, 1     , "s", "Record Interval"},   \
-    {8, DEGREE, "°C", "Setpoint"},            \
-    {1, 1     , "BOOL", "BOD Triggered"}
+// Number of the most recent logs whose start is remembered, so they can be found without a search
+#define LOG_INDEX_LEN              16
+
+// Time (mS) of readings between checkpoints of the time into a log, so part of a long one can be
+// found without unpacking everything before it, but at least this many readings and words
+// apart. Each repeats the last value of these variables.
+#define LOG_CHECKPOINT_INTERVAL    (600*mS)
+#define LOG_CHECKPOINT_READINGS    16
+#define LOG_CHECKPOINT_MIN_WORDS   32
+#define LOG_CHECKPOINT_STATE       LOG_RECORD_INTERVAL, LOG_SETPOINT_SET, LOG_ON_PERCENTAGE
+#define LOG_CHECKPOINT_STATE_LEN   3
+
+// Once a log has used half the store its record interval is doubled each time the space left
+// to it halves, up to this many times, so a long run still fits. Readings are kept at the set
+// interval for this long (mS) after the setpoint changes. No interval, set or stretched, is
+// longer than LOG_MAX_INTERVAL (mS), the most the log can hold.
+#define LOG_MAX_THINNING           7
+#define LOG_FINE_WINDOW            (120*mS)
+#define LOG_MAX_INTERVAL           (4095*mS)
+
+// The lowest and highest temperatures and outputs in an interval are logged if they're further
+// than these from its average, and their spreads if the range is wider than that
+#define LOG_RANGE_TOLERANCE        DEGREE
+#define LOG_OUTPUT_TOLERANCE       10
+
+// Average temperatures this close to the last logged are logged as that, so a steady hold goes in
+// as runs of repeats
+#define LOG_STEADY_TEMPERATURE     (DEGREE/2)
+
+// Number of PID iterations kept in RAM, to be logged when something notable happens, and how far
+// past the setpoint the temperature must go to count
+#define RECORDER_FRAMES            32
+#define RECORDER_OVERSHOOT_LIMIT   (10*DEGREE)
 
 // ------ Pin Settings
 // -------------------
@@ -130,8 +213,8 @@ typedef uint32_t BOOL;
  *   **UART_TX** 5--PIO0_4      Vss------16 **Gnd**
  *       **TCK** 6--PIO0_3      Vdd------15 **3v3 Out**
  *       **TMS** 7--PIO0_2      PIO0_8---14 **XTALIN**
- *               8--PIO0_11     PIO0_9---13 **XTALOUT**
- *               9--PIO0_10     PIO0_1---12 HEATER
+ *     (I2C_SDA) 8--PIO0_11     PIO0_9---13 **XTALOUT**
+ *     (I2C_SCL) 9--PIO0_10     PIO0_1---12 HEATER
  *              10--PIO0_16     PIO0_15--11 SPI_MISO
  */
 
@@ -156,6 +239,14 @@ typedef uint32_t BOOL;
 #define UART_TX_PIN         4
 #define UART_RX_PIN         0
 
+// I2C, for the external log store
+#define I2C_SDA_PIN         11
+#define I2C_SCL_PIN         10
+#define FRAM_I2C_ADDR       0x50        // 7 bit device address
+#define FRAM_I2C_BITRATE    400000
+#define FRAM_SIZE           32768       // Bytes in the device (FM24W256)
+#define FRAM_PAGE_LEN       FRAM_SIZE   // Write page size; set to the page size for an EEPROM
+
 // ============================================================================================
 // ============================================================================================
 // ============================================================================================
@@ -171,26 +262,30 @@ typedef uint32_t BOOL;
 
 typedef enum {  CONFIG_ITEM_version, CONFIG_ITEM_logOutputCSV, CONFIG_ITEM_setPoint,
                 CONFIG_ITEM_recordInterval, CONFIG_ITEM_PID, CONFIG_ITEM_defaultProfile, CONFIG_ITEM_K,
+                CONFIG_ITEM_logSelect,
                 CONFIG_ITEM_defaults, CONFIG_ITEM_reload, CONFIG_ITEM_help, CONFIG_ITEM_end
              } config_item_enum;
 
-#define LEATER_CONFIG_STRINGLIST "Version","logOutputCSV","setPoint","recordInterval", "PID", "defaultProfile", "K", "defaults", "reload", "help", 0
+#define LEATER_CONFIG_STRINGLIST "Version","logOutputCSV","setPoint","recordInterval", "PID", "defaultProfile", "K", "logSelect", "defaults", "reload", "help", 0
 
-// The internal structure of the config - if this is changed, then you _must_ update the version number
+// The internal structure of the config - if this is changed, then you _must_ update the version number.
+// Only these settings are kept in RAM; the profiles stay in nv ram and are read from there (see nvProfile).
 typedef struct
 {
     uint32_t    version;            // Version of the datafile
     BOOL        logOutputCSV;       // Are we outputting CSV or formatted?
     uint32_t    setPoint;           // What is the current setpoint?
-    uint32_t    recordInterval;             // Interval between recordings into the log
+    uint32_t    recordInterval;             // Interval between recordings into the log (mS)
     uint32_t    k;                          // Filter k value (bits)
     int32_t     Cp;                         // PID P value
     int32_t     Ci;                         // PID I value
     int32_t     Cd;                         // PID D value
-    ProfileType profile[MAX_PROFILES];      // Profiles
     uint32_t    defaultProfile;             // ....and the default profile to use
+    uint8_t     logEvery[LOG_MAX_VARIABLES]; // Log one in this many of each variable, 0 for none
 } ConfigStoreType;
 
 // The configuration of the overall system
 extern ConfigStoreType sysConfig;
+extern const ConfigStoreType defaultSysConfig;
+extern const ProfileType defaultProfiles[MAX_PROFILES];
 #endif
@@ -5,7 +5,12 @@
 #include "config.h"
 
 #ifdef DEBUG
+#ifdef HOST_BUILD
+#include <assert.h>
+#define ASSERT(x) assert(x);
+#else
 #define ASSERT(x) if (!(x)) __ASM volatile("BKPT #01");
+#endif
 //#define NV_STORE_START 0x3400             // Storage range for logging in debug mode
 #else
 #define ASSERT(x)
@@ -26,6 +31,8 @@
 #define _dsignnumdiv(a,b) (((a)>=0)?(a)/(b):-((-(a))/(b)))  /* Performed signed division correctly */
 void denter_critical(void);                                 // Enter a critical section
 void dleave_critical(void);                                 // Exit a critical section
+uint32_t dcrc32(uint32_t crc, const void *data,
+                uint32_t len);                              // Running CRC-32 over a block of data
 // ============================================================================================
 
 #endif /* DUTILS_H_ */
@@ -0,0 +1,17 @@
+/*
+ * I2C driver for an external FRAM or EEPROM, used to hold the log when LOG_STORE_FRAM is defined.
+ */
+
+#ifndef FRAM_H_
+#define FRAM_H_
+
+#include "config.h"
+
+// ============================================================================================
+BOOL framRead(uint32_t addr, void *data, uint32_t len);         // Read from the device
+BOOL framWrite(uint32_t addr, const void *data, uint32_t len);  // Write to the device
+BOOL framWait(void);                                            // Wait for the device to be ready
+
+BOOL framInit(void);                // Initialise the bus and check the device is there
+// ============================================================================================
+#endif /* FRAM_H_ */
@@ -5,7 +5,7 @@
  *
 * Non-volatile storage. Contains two things; The config (at the end of the available space) and the rest of the
  * spare flash is given over to generic storage, which can only be read from/written to in a stream manner. Note that
- * 0xFFFFFFFF is not allowed to the written, as that's used to flag empty memory!  So we have to bit-stuff.
+ * 0xFFFFFFFF is not allowed to the written, as that's used to flag empty memory!  So the log keeps a bit clear.
  * We don't have any real backup memory so this is the only easy way to find out where is empty.
  */
 
@@ -24,22 +24,51 @@ typedef enum {NV_OK, NV_ERROR, NV_ENDSTATE} nvState;
 // ----- nv Iterators
 typedef struct
 {
-    uint32_t *rp;
+    uint32_t *rp;           // Position in the store (a device address for external ones)
     nvState state;
 } nvIterator;
 
+// ----- Kinds of flash work that get queued
+typedef enum {NV_JOB_NONE, NV_JOB_PROGRAM, NV_JOB_ERASE, NV_JOB_CONFIG, NV_JOB_TYPES} nvJobType;
+
+// ----- Counters for flash activity, so the cost of logging can be seen
+typedef struct
+{
+    uint32_t entries;       // Words handed to the store
+    uint32_t programs;      // IAP block program calls
+    uint32_t erases;        // IAP page erase calls
+    uint32_t seekReads;     // Words examined while looking for the write position or a session
+    uint32_t jobs;          // Queued flash jobs run
+    uint32_t forced;        // ...of which were run early because the queue was full
+    uint32_t failures;      // ...and which didn't work
+    uint32_t jobMax[NV_JOB_TYPES]; // Worst time (uS) each kind of job held things up for
+} nvStatsType;
+
 // ============================================================================================
 // Information about the part
 // --------------------------
 uint32_t nvRead_partID(void);                           // Read the ROM version identifier
 uint32_t nvRead_partVersion(void);                      // Read the part identifier
 
-// Read/write to/from NV
-// ---------------------
+// Log store. These are provided by whichever backend is configured; the spare flash (nv.c)
+// or, with LOG_STORE_FRAM defined, an external FRAM/EEPROM (nvfram.c)
+// --------------------------------------------------------------------------------------
+BOOL nvLogInit(void);                                   // Initialise the log store
 BOOL nvWrite_entry(uint32_t val_to_write);              // Write value to store
-uint32_t nvGetSpace(void);                              // Return the amount of free space left
+BOOL nvMakeRoom(void);                                  // Do the store work the next entry could need
+BOOL nvAppend(uint32_t val_to_write);                   // Write value with no store work, after nvMakeRoom
+uint32_t nvGetSpace(void);                              // Return space left before old data is dropped
+uint32_t nvSpaceAfter(nvIterator *n);                   // Return space left before data from n is dropped
 uint32_t nvTotalSpace(void);
 BOOL nvFlush(void);                                     // Flush the whole of the log memory
+uint32_t nvNumSectors(void);                            // Return the number of sectors given to the log
+uint32_t nvSectorWear(uint32_t sector);                 // Return the erase count for a log sector
+BOOL nvSync(void);                                      // Queue any part-filled write block for flash
+BOOL nvProgramNow(void);                                // Program waiting blocks now, leaving erases
+BOOL nvRunJob(void);                                    // Run one waiting flash job
+void nvDrain(void);                                     // Run all waiting flash jobs now
+void nvTimeout(uint32_t timerNumber);                   // Timer callback - commit pending writes etc.
+void nvGetStats(nvStatsType *s);                        // Return a copy of the flash activity counters
 // Return total space in NV memory
 uint32_t nvTotalSpace(void);                            // Iterator over NV storage for read access
 
@@ -47,13 +76,18 @@ uint32_t nvTotalSpace(void);                            // Iterator over NV stor
 nvState nvIteratorState(nvIterator *n);                 // Return current state of iterator
 uint32_t nvIteratorNext(nvIterator *n);                 // Get next entry from nv store
 void nvInitIterator(nvIterator *n);                     // Initialise read iterator
+void nvInitIteratorEnd(nvIterator *n);                  // Initialise read iterator at the write position
+uint32_t nvIteratorPrev(nvIterator *n);                 // Get previous entry from nv store
+uint32_t nvCursor(nvIterator *n);                       // Return a cursor for where an iterator has got to...
+BOOL nvGotoCursor(nvIterator *n, uint32_t cursor);      // ...and go back there, if the data's still in the store
 
 // Configuration storage read/write
 // --------------------------------
-BOOL nvWriteConfig(const ConfigStoreType
-                   *c);           // Scrub and re-write the config to nv memory
-void nvReadConfig(ConfigStoreType
-                  *c);                  // Get configuration from nv ram into config buffer
+BOOL nvWriteConfig(const ConfigStoreType *c,
+                   const ProfileType *profiles);        // Write the config (and profiles, if given) into the slot not in use
+BOOL nvReadConfig(ConfigStoreType
+                  *c);                  // Get newest good configuration from nv ram into config buffer
+const ProfileType *nvProfile(uint32_t profileNum);      // Return a profile, read in place from nv ram
 
 // ...and the initialisation function
 // ----------------------------------
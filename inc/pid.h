@@ -21,6 +21,7 @@ typedef struct
     int32_t prevError;
     int32_t prevPv;
     int32_t integral;
+    int32_t derivative;
     int32_t integralLimit;
     int32_t outputMax;
     int32_t outputMin;
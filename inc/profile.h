@@ -1,6 +1,6 @@
 /*
  * Execute a stored temperature profile. The profiles themselves are defined externally and are kept
- * in the sysConfig structure.
+ * alongside the config in nv ram, where they're read in place through nvProfile.
  */
 
 #ifndef PROFILE_H_
@@ -0,0 +1,44 @@
+/*
+ * Flight recorder for the PID loop. Every iteration is kept in a small RAM ring, which is frozen
+ * and written to the log only when something notable happens.
+ */
+
+#ifndef RECORDER_H_
+#define RECORDER_H_
+
+#include "config.h"
+#include "pid.h"
+
+#ifndef RECORDER_FRAMES
+#error "RECORDER_FRAMES must be defined"
+#endif
+
+#define RECORDER_FRAME_WORDS 3              // Log words used by each iteration
+
+// Why the recording was frozen. Ensure the names match the list.
+typedef enum {RECORDER_MANUAL, RECORDER_SENSOR_FAULT, RECORDER_OVERSHOOT, RECORDER_BROWNOUT} recorderReasonType;
+#define RECORDERNAMES "Manual","Sensor Fault","Overshoot","Brownout"
+
+// One iteration of the loop, as read back from the log
+typedef struct
+{
+    int32_t pv;                 // Temperature read
+    int32_t setPoint;
+    int32_t error;
+    int32_t integral;
+    int32_t derivative;
+    int32_t output;
+} recorderFrameType;
+
+// ============================================================================================
+void recorderAdd(int32_t pv, pidInstanceType *p);           // Record an iteration of the PID loop
+void recorderTrigger(recorderReasonType reason);            // Freeze the recording, to be logged when possible
+void recorderService(void);                                 // Log the recording if it's frozen and that's possible
+uint32_t recorderTake(recorderReasonType reason, uint32_t *frozenFor,
+                      const uint32_t **words);              // Freeze the recording and hand it over to log now
+void recorderDecode(const uint32_t *words,
+                    recorderFrameType *f);                  // Unpack an iteration read back from the log
+const char *recorderReasonName(uint32_t reason);            // Return the name of a reason for freezing
+void recorderInit(void);                                    // Initialise the recorder
+// ============================================================================================
+#endif /* RECORDER_H_ */
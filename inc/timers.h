@@ -21,7 +21,7 @@
 // Origins (and callbacks) for timer events
 typedef enum {TIMER_ORIGIN_ILLEGAL, TIMER_ORIGIN_STATEMACHINE, TIMER_ORIGIN_UART, \
               TIMER_ORIGIN_BOD, TIMER_ORIGIN_PROFILE, TIMER_ORIGIN_LEDFLASH, TIMER_ORIGIN_HEATER, \
-              TIMER_ORIGIN_COMMAND, TIMER_ORIGIN_SENSOR
+              TIMER_ORIGIN_COMMAND, TIMER_ORIGIN_SENSOR, TIMER_ORIGIN_NV
              } timerOriginType;
 
 typedef struct timerStruct
@@ -45,6 +45,7 @@ void timerDel(timerType *t);                // Delete a running timer
 BOOL timerRunning(timerType *t);            // Return if this timer is active or not
 void timerDispatch(void);                   // Called when a timer has matured
 uint32_t timerSecs(void);                   // Get number of second ticks since system started
+uint32_t timerMicros(void);                 // Get free running uS count for timing short intervals
 
 void timersInit(void);                      // Initalise timer subsystem
 void timerInit(timerType *t);               // Initialise an individual timer
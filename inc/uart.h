@@ -24,7 +24,7 @@
 #define UART                    LPC_USART0   // The particular UART to be using
 #define TIMER_INIT_DELAY        3000    // Initalisation after 3 seconds
 #define UART_RX_LINELEN         80      // Maximum length of an incoming line
-#define UART_TX_BUFFSIZE        512     // Maximum number of bufferable characters on transmit side
+#define UART_TX_BUFFSIZE        640     // Maximum number of bufferable characters on transmit side
 
 #define USE_ECHO 1
 #define UART_USECRLF            TRUE    // Use CRLF pair
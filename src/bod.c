@@ -6,6 +6,8 @@
 #include "bod.h"
 #include "timers.h"
 #include "log.h"
+#include "nv.h"
+#include "recorder.h"
 
 static BOOL bodActive;              // Flag indicating that brownout has been triggered
 static timerType t;                 // Timer for this state machine
@@ -18,6 +20,20 @@ void BOD_IRQHandler(void)
 // IRQ from brownout system
 
 {
+    const uint32_t *words;
+    uint32_t reason, count;
+
+    // Get anything still waiting in RAM into flash while there's enough voltage to do it, down
+    // to the records not yet making up a whole word. That marks the brownout in the log too, and
+    // what the PID loop was doing goes in behind it. Erases take too long, so they stay queued
+    // for when the power's back.
+    if (!bodActive)
+        {
+            count=recorderTake(RECORDER_BROWNOUT, &reason, &words);
+            logPowerFail(LOG_PID_TRACE, reason, words, count);
+            nvProgramNow();
+        }
+
     if (bodActive) timerDel(&t); // This shouldn't really happen
     timerAdd(&t, TIMER_ORIGIN_BOD, 0, BOD_RECOVERY_TIME);
     bodActive=TRUE;
@@ -43,11 +59,11 @@ BOOL bodIsActive(void)
 // ============================================================================================
 void bodTimeout(void)
 
-// The brownout has timed out - release the IRQ to trigger again if needed
+// The brownout has timed out - release the IRQ to trigger again if needed. It was logged as it
+// happened.
 
 {
     bodActive=FALSE;
-    logWrite(LOG_BOD_TRIGGERED,TRUE);
     NVIC_EnableIRQ(BOD_IRQn);
 }
 // ============================================================================================
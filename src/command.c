@@ -6,6 +6,7 @@
 #include <ctype.h>
 #include <string.h>
 #include "config.h"
+#include "dutils.h"
 #include "command.h"
 #include "uart.h"
 #include "nv.h"
@@ -15,6 +16,7 @@
 #include "bod.h"
 #include "profile.h"
 #include "timers.h"
+#include "recorder.h"
 
 // ============================================================================================
 #define MAX_PARAMS 8 // Maximum number of parameters to be passed in any routine
@@ -36,11 +38,25 @@ typedef struct
 
 static timerType t;                 // For refreshing the display
 static BOOL paramsModified;         // Have parameters been modified and not comitted?
+static BOOL profilesDefaulted;      // Are the built-in profiles to go back in at the next commit?
 
 const char * const sysConfigStrings[] =
 { LEATER_CONFIG_STRINGLIST };
 
 #define CL_REFRESH_INTERVAL     (1*mS)
+#define DUMP_NONE               0xFFFFFFFF  // Dumplog has no value of this to show
+
+// Frames sent by Binlog; two sync bytes, then the type, the frame number and the payload length
+// (both 16 bits), the payload and a CRC32 over everything from the type on. All little endian.
+#define BINLOG_SYNC             0xA55A      // Starts every frame, 0xA5 first
+#define BINLOG_HEADER_LEN       7           // Bytes ahead of the payload
+#define BINLOG_CRC_LEN          4           // ...and after it
+#define BINLOG_PAYLOAD          128         // Most bytes of payload in a frame
+#define BINLOG_RECORD_LEN       16          // Bytes in each decoded record
+#define BINLOG_WORDS            'W'         // Frame of raw words from the store
+#define BINLOG_RECORDS          'R'         // Frame of decoded records
+#define BINLOG_CURSOR           'C'         // Cursor to start or carry on from, then 1 if the one given was lost
+#define BINLOG_END              'E'         // Last frame, payload is 1 if the store ran out
 // ============================================================================================
 // Internal routines
 // ============================================================================================
@@ -140,34 +156,41 @@ COMMAND(_loginfo)
 
 {
     logIterator n;
-    uint32_t entryCount = 0;
-    uint32_t logNumber = 0;
-    BOOL noMoreData;
+    logSummaryType l;
+    uint32_t logCount = 0;
+    uint32_t sector = 0;
+    nvStatsType s;
 
+    // Only the summaries are read, not the records themselves
     logInitIterator(&n);
-    do
+    while (logNextSummary(&n, &l))
         {
-            noMoreData = logIteratorNext(&n);
-            if (logNumber != logCurrentLog(&n))
-                {
-                    // This is a new log entry - so if we've already got one then report it
-                    if (logNumber) commandprintf("%3d:%5d entries\n", logNumber, entryCount);
-                    logNumber++;
-                    entryCount = 0;
-                }
-            else
-                entryCount++;
+            commandprintf("%3d:%5d entries %6ds", l.logNum, l.entries, l.duration);
+            if (l.maxTemp != TEMP_INVALID)
+                commandprintf(" %3d-%3d°C", l.minTemp / DEGREE, l.maxTemp / DEGREE);
+            if (l.profile != LOG_NO_PROFILE)
+                commandprintf(" profile %d", l.profile + 1);
+            commandprintf("%s\n", (l.logNum == logNumLogs()) ? " (Still Active)" : "");
+            logCount++;
         }
-    while (noMoreData);
-    if (logNumber)
-        commandprintf("%3d:%5d entries %s\n", logNumber, entryCount,
-                      (logNumber == logNumLogs()) ? "(Still Active)" : "");
 
     commandprintf("Current log number is       : %d\n", logNumLogs());
-    commandprintf("Number of logs with records : %d (inc. active one)\n", logNumber);
-    commandprintf("Amount of remaining space   : %d Bytes (%d%%)\n", nvGetSpace(),
+    if (logBadWords(&n)) commandprintf("Damaged words skipped       : %d\n", logBadWords(&n));
+    commandprintf("Number of logs with records : %d (inc. active one)\n", logCount);
+    commandprintf("Space before oldest dropped : %d Bytes (%d%%)\n", nvGetSpace(),
                   (nvGetSpace() * 100) / nvTotalSpace());
+    commandprintf("Sector erase counts         :");
+    while (sector < nvNumSectors())
+        commandprintf(" %d", nvSectorWear(sector++));
+    commandprintf("\n");
 
+    nvGetStats(&s);
+    commandprintf("Flash activity this boot    : %d words, %d programs, %d erases\n", s.entries,
+                  s.programs, s.erases);
+    commandprintf("Words read seeking the end  : %d\n", s.seekReads);
+    commandprintf("Flash jobs run              : %d (%d early, %d failed)\n", s.jobs, s.forced, s.failures);
+    commandprintf("Worst job time (uS)         : program %d, erase %d, config %d\n",
+                  s.jobMax[NV_JOB_PROGRAM], s.jobMax[NV_JOB_ERASE], s.jobMax[NV_JOB_CONFIG]);
     return TRUE;
 }
 // ============================================================================================
@@ -271,16 +294,17 @@ COMMAND(_internal_setparam)
                         return FALSE;
                     }
                 uint32_t recordInterval;
-                recordInterval = _datoi(param[2]);
-                if (recordInterval > 0)
+                recordInterval = _datosf(param[2], mS);
+                if ((recordInterval >= CYCLE_LEN) && (recordInterval <= LOG_MAX_INTERVAL))
                     {
                         sysConfig.recordInterval = recordInterval;
-                        commandprintf("Record interval set to %dS\n", recordInterval);
+                        commandprintf("Record interval set to %d.%03dS\n", recordInterval / mS, recordInterval % mS);
                         return TRUE;
                     }
                 else
                     {
-                        commandprintf("Illegal record interval\n");
+                        commandprintf("Record interval must be %d.%03d-%dS\n", CYCLE_LEN / mS, CYCLE_LEN % mS,
+                                      LOG_MAX_INTERVAL / mS);
                         return FALSE;
                     }
                 // -----------------------
@@ -307,6 +331,39 @@ COMMAND(_internal_setparam)
                 sysConfig.k = _datoi(param[2]);
                 return TRUE;
                 // -----------------------
+            case CONFIG_ITEM_logSelect:
+                if (nparams == 2)
+                    {
+                        uint32_t v = 0;
+                        while (logNameOf(v))
+                            {
+                                commandprintf("%2d %s: ", v, logNameOf(v));
+                                if (sysConfig.logEvery[v]) commandprintf("1 in %d\n", sysConfig.logEvery[v]);
+                                else
+                                    commandprintf("Not logged\n");
+                                v++;
+                            }
+                        return TRUE;
+                    }
+                if (nparams != 4)
+                    {
+                        commandprintf("Syntax: logSelect [<Variable> <1 in how many, 0 for none>]\n");
+                        return FALSE;
+                    }
+
+                uint32_t logVar, logEvery;
+                logVar = _datoi(param[2]);
+                logEvery = _datoi(param[3]);
+                if (!logCanSelect(logVar, logEvery))
+                    {
+                        commandprintf("Variable can't be logged that way\n");
+                        return FALSE;
+                    }
+
+                sysConfig.logEvery[logVar] = logEvery;
+                logSelect(sysConfig.logEvery);
+                return TRUE;
+                // -----------------------
             case CONFIG_ITEM_defaultProfile:
                 if (nparams != 3)
                     {
@@ -341,17 +398,19 @@ COMMAND(_internal_setparam)
 
                 // -----------------------
             case CONFIG_ITEM_defaults:
-                commandprintf("Defaults loaded\n");
-                ConfigStoreType defaultSysConfig =
-                { LEATER_CONFIG };     // This needs to be done here because string init cannot be done at global level
-                memcpy(&sysConfig, &defaultSysConfig, sizeof(&defaultSysConfig));
+                commandprintf("Defaults loaded, built-in profiles go back in at the next commit\n");
+                sysConfig = defaultSysConfig;
+                profilesDefaulted = TRUE;
                 statePIDSet();  // Let the state machine know there has been a change
+                logSelect(sysConfig.logEvery);
                 return TRUE;
                 // ---------------------
             case CONFIG_ITEM_reload:
                 nvReadConfig(&sysConfig);
+                profilesDefaulted = FALSE;
                 commandprintf("Stored config reloaded\n");
                 statePIDSet();  // Let the state machine know there has been a change
+                logSelect(sysConfig.logEvery);
                 return TRUE;
                 // -------------------
             case CONFIG_ITEM_help:
@@ -429,6 +488,7 @@ COMMAND(_dumpparam)
 {
     uint32_t profileNum = 0;
     uint32_t profileStep;
+    uint32_t logVar = 0;
 
     commandprintf("[%s] Config Version        : 0x%08X\n", sysConfigStrings[CONFIG_ITEM_version],
                   sysConfig.version);
@@ -441,8 +501,12 @@ COMMAND(_dumpparam)
                   sysConfig.Cp, sysConfig.Ci,
                   sysConfig.Cd);
     commandprintf("[%s] LowPass 	                : %d\n", sysConfigStrings[CONFIG_ITEM_K], sysConfig.k);
-    commandprintf("[%s] Report interval: %d S\n", sysConfigStrings[CONFIG_ITEM_recordInterval],
-                  sysConfig.recordInterval);
+    commandprintf("[%s] Report interval: %d.%03d S\n", sysConfigStrings[CONFIG_ITEM_recordInterval],
+                  sysConfig.recordInterval / mS, sysConfig.recordInterval % mS);
+    commandprintf("[%s] Logged (1 in N)     :", sysConfigStrings[CONFIG_ITEM_logSelect]);
+    while (logNameOf(logVar))
+        commandprintf(" %d", sysConfig.logEvery[logVar++]);
+    commandprintf("\n");
     commandprintf("[%s] Autorun        : ", sysConfigStrings[CONFIG_ITEM_defaultProfile]);
     if (sysConfig.defaultProfile <= MAX_PROFILES) commandprintf("%d\n", sysConfig.defaultProfile);
     else if (sysConfig.defaultProfile == SETPOINT_IDLE) commandprintf("IDLE\n");
@@ -455,18 +519,18 @@ COMMAND(_dumpparam)
     commandprintf("Profiles....\n");
     do
         {
-            commandprintf("%d: %s;\n", profileNum + 1, sysConfig.profile[profileNum].name);
+            commandprintf("%d: %s;\n", profileNum + 1, nvProfile(profileNum)->name);
             profileStep = 0;
             do
                 {
                     commandprintf("    %d %s %3d°C in %3d seconds\n", profileStep + 1,
-                                  profileGetStepname((sysConfig.profile[profileNum].step[profileStep].command & PROFILE_COMMAND_MASK)
+                                  profileGetStepname((nvProfile(profileNum)->step[profileStep].command & PROFILE_COMMAND_MASK)
                                                      >> 28),
-                                  ((sysConfig.profile[profileNum].step[profileStep].temp) & PROFILE_TEMP_MASK) / DEGREE,
-                                  (sysConfig.profile[profileNum].step[profileStep].time) / mS);
+                                  ((nvProfile(profileNum)->step[profileStep].temp) & PROFILE_TEMP_MASK) / DEGREE,
+                                  (nvProfile(profileNum)->step[profileStep].time) / mS);
                 }
             while ((++profileStep < MAX_PROFILE_STEPS)
-                    && ((sysConfig.profile[profileNum].step[profileStep].command & PROFILE_COMMAND_MASK) !=
+                    && ((nvProfile(profileNum)->step[profileStep].command & PROFILE_COMMAND_MASK) !=
                         PROFILE_END));
         }
     while (++profileNum < MAX_PROFILES);
@@ -477,10 +541,12 @@ COMMAND(_dumpparam)
 COMMAND(_commit)
 
 // Commit the current in-memory parameters to non-volatile storage, and print them out too for good measure.
+// After a reset to defaults the built-in profiles go in too, in place of the stored ones.
 
 {
-    if (!nvWriteConfig(&sysConfig)) return FALSE;
+    if (!nvWriteConfig(&sysConfig, profilesDefaulted ? defaultProfiles : NULL)) return FALSE;
     paramsModified = FALSE;
+    profilesDefaulted = FALSE;
 
     return _dumpparam(nparams, param);
 }
@@ -580,20 +646,64 @@ COMMAND(_stop)
     return profileStop();
 }
 // ============================================================================================
+COMMAND(_trace)
+
+// Freeze what the PID loop has been doing, so it's written to the log
+
+{
+    recorderTrigger(RECORDER_MANUAL);
+    commandprintf("PID trace will be logged at the next reading\n");
+    return TRUE;
+}
+// ============================================================================================
+void _dumptrace(logIterator *n)
+
+// Print the PID iterations from a trace record
+
+{
+    uint32_t w[RECORDER_FRAME_WORDS];
+    recorderFrameType f;
+    uint32_t i = 0;
+
+    commandprintf("%7ds PID Trace (%s), oldest first\n", logTime(n), recorderReasonName(logValue(n)));
+    while (logBlock(n, i * RECORDER_FRAME_WORDS, w, RECORDER_FRAME_WORDS) == RECORDER_FRAME_WORDS)
+        {
+            recorderDecode(w, &f);
+            commandprintf("   PV:%d S:%d E:%d I:%d D:%d O:%d\n", f.pv, f.setPoint, f.error, f.integral, f.derivative,
+                          f.output);
+            i++;
+        }
+}
+// ============================================================================================
 COMMAND(_dumplog)
 
-// Dump a specific log out
+// Dump a specific log out, optionally only the readings from a window of time into it, and only
+// every so many of those
 
 {
     logIterator n;
     uint32_t entryCount = 0, currentLog = 0, compareLog = 0;
-    uint32_t logInterval = 0, logTime = 0, oldPct = 0, logSetpoint = 0;
+    uint32_t oldPct = 0, logSetpoint = 0;
+    uint32_t lowest = DUMP_NONE, highest = DUMP_NONE, spread = DUMP_NONE;
+    uint32_t pctLowest = DUMP_NONE, pctHighest = DUMP_NONE, pctSpread = DUMP_NONE;
+    uint32_t from = 0, to = 0xFFFFFFFF, every = 1, readings = 0;
+    BOOL csvHeader = sysConfig.logOutputCSV;    // Heading still to be output?
+
+    if ((nparams != 2) && (nparams != 4) && (nparams != 5)) return FALSE;
 
     if (!strcmp((char *) param[1], "ALL")) compareLog = 0;
     else
         compareLog = _datoi(param[1]);
 
+    if (nparams >= 4)
+        {
+            from = _datoi(param[2]);
+            to = _datoi(param[3]);
+        }
+    if ((nparams == 5) && (_datoi(param[4]))) every = _datoi(param[4]);
+
     logInitIterator(&n);
+    if (compareLog) logGotoLog(&n, compareLog);
     while (logIteratorNext(&n))
         {
             if (currentLog != logCurrentLog(&n))
@@ -602,29 +712,82 @@ COMMAND(_dumplog)
                             && (!sysConfig.logOutputCSV))
                         commandprintf("%d entries\n", entryCount);
 
+                    // Nothing more to show once past the log asked for
+                    if ((compareLog) && (logCurrentLog(&n) > compareLog)) break;
+
                     currentLog = logCurrentLog(&n);
                     entryCount = 0;
+                    readings = 0;
                     oldPct = 0;
-                    logTime = 0;
-                    logInterval = 0;
                     if (((compareLog == 0) || (compareLog == currentLog)) && (!sysConfig.logOutputCSV))
                         commandprintf("\n\nLog Number %d\n", currentLog);
 
-                    if ((sysConfig.logOutputCSV) && (currentLog == 1))
-                        commandprintf("Log Number,Time (s),Temp (°C),On Time (%%),Setpoint (°C)\n");
+                    if (csvHeader)
+                        {
+                            commandprintf("Log Number,Time (s),Temp (°C),On Time (%%),Setpoint (°C)\n");
+                            csvHeader = FALSE;
+                        }
+
+                    // Skip whatever comes before the window, this record included
+                    if ((from) && (logGotoTime(&n, from))) continue;
                 }
+
+            // Once past the window move on to the next log
+            if (logTime(&n) > to)
+                {
+                    if ((compareLog) || (!logGotoLog(&n, currentLog + 1))) break;
+                    continue;
+                }
+
             if ((compareLog == 0) || (compareLog == currentLog))
                 switch (logVariable(&n))
                     {
                         case LOG_TEMPERATURE:
-                            logTime += logInterval;
-                            if (sysConfig.logOutputCSV) commandprintf("%d,%d,%d.%d,%d,%d\n", currentLog, logTime,
-                                        logValue(&n) / DEGREE,
+                            if ((logTime(&n) < from) || (readings++ % every)) break;
+                            if (sysConfig.logOutputCSV) commandprintf("%d,%d.%03d,%d.%d,%d,%d\n", currentLog,
+                                        logTime(&n), logTimeMs(&n) % mS, logValue(&n) / DEGREE,
                                         (logValue(&n) / 10) % DEGREE, oldPct, logSetpoint / DEGREE);
                             else
-                                commandprintf("%7ds S:%d°C A:%d.%d°C %d%% On time\n", logTime, logSetpoint / DEGREE,
-                                              logValue(&n) / DEGREE,
-                                              ((logValue(&n) * 10) / DEGREE) % 10, oldPct);
+                                {
+                                    commandprintf("%7d.%03ds S:%d°C A:%d.%d°C %d%% On time", logTime(&n), logTimeMs(&n) % mS,
+                                                  logSetpoint / DEGREE,
+                                                  logValue(&n) / DEGREE,
+                                                  ((logValue(&n) * 10) / DEGREE) % 10, oldPct);
+                                    if (lowest != DUMP_NONE)
+                                        commandprintf(" L:%d.%d°C", lowest / DEGREE, ((lowest * 10) / DEGREE) % 10);
+                                    if (highest != DUMP_NONE)
+                                        commandprintf(" H:%d.%d°C", highest / DEGREE, ((highest * 10) / DEGREE) % 10);
+                                    if (spread != DUMP_NONE)
+                                        commandprintf(" SD:%d.%d°C", spread / DEGREE, ((spread * 10) / DEGREE) % 10);
+                                    if (pctLowest != DUMP_NONE) commandprintf(" L:%d%%", pctLowest);
+                                    if (pctHighest != DUMP_NONE) commandprintf(" H:%d%%", pctHighest);
+                                    if (pctSpread != DUMP_NONE) commandprintf(" SD:%d%%", pctSpread);
+                                    commandprintf("\n");
+                                }
+                            break;
+
+                        case LOG_TEMPERATURE_MIN:
+                            lowest = logValue(&n);
+                            break;
+
+                        case LOG_TEMPERATURE_MAX:
+                            highest = logValue(&n);
+                            break;
+
+                        case LOG_TEMPERATURE_SPREAD:
+                            spread = logValue(&n);
+                            break;
+
+                        case LOG_ON_PERCENTAGE_MIN:
+                            pctLowest = logValue(&n);
+                            break;
+
+                        case LOG_ON_PERCENTAGE_MAX:
+                            pctHighest = logValue(&n);
+                            break;
+
+                        case LOG_ON_PERCENTAGE_SPREAD:
+                            pctSpread = logValue(&n);
                             break;
 
                         case LOG_ON_PERCENTAGE:
@@ -632,19 +795,217 @@ COMMAND(_dumplog)
                             break;
 
                         case LOG_RECORD_INTERVAL:
-                            logInterval = logValue(&n);
                             break;
 
                         case LOG_SETPOINT_SET:
                             logSetpoint = logValue(&n);
                             break;
 
+                        case LOG_PID_TRACE:
+                            if ((logTime(&n) >= from) && (!sysConfig.logOutputCSV)) _dumptrace(&n);
+                            break;
+
                         default:
-                            commandprintf("%7ds %s: %d %s\n", logTime, logVariableName(&n), logValue(&n), logUnits(&n));
+                            if (logTime(&n) >= from)
+                                commandprintf("%7ds %s: %d %s\n", logTime(&n), logVariableName(&n), logValue(&n), logUnits(&n));
                             break;
                     }
-            entryCount++;
+            if (logVariable(&n) == LOG_TEMPERATURE)
+                lowest = highest = spread = pctLowest = pctHighest = pctSpread = DUMP_NONE;
+            if (!logIsCarried(&n)) entryCount++;
+        }
+    return TRUE;
+}
+// ============================================================================================
+static void _binPut(uint8_t *p, uint32_t val, uint32_t len)
+
+// Put a value into a frame, least significant byte first
+
+{
+    while (len--)
+        {
+            *p++ = val & 0xFF;
+            val >>= 8;
+        }
+}
+// ============================================================================================
+static uint32_t _binItem(logIterator *n, nvIterator *v, uint8_t *p)
+
+// Put the next word (given an nv iterator) or record into a frame, returning the bytes it took,
+// or 0 at the end of the store. A decoded record is the log number, the time into it in mS and
+// the value (32 bits each), then the variable, 1 if it was carried by a checkpoint, and two
+// spare bytes.
+
+{
+    uint32_t w;
+
+    if (v)
+        {
+            if ((w = nvIteratorNext(v)) == NV_EMPTY) return 0;
+            _binPut(p, w, 4);
+            return 4;
         }
+
+    if (!logIteratorNext(n)) return 0;
+    _binPut(p, logCurrentLog(n), 4);
+    _binPut(p + 4, logTimeMs(n), 4);
+    _binPut(p + 8, logValue(n), 4);
+    p[12] = logVariable(n);
+    p[13] = logIsCarried(n);
+    _binPut(p + 14, 0, 2);
+    return BINLOG_RECORD_LEN;
+}
+// ============================================================================================
+static void _binFrame(uint8_t *f, uint8_t type, uint32_t frame, uint32_t len)
+
+// Fill in the header and CRC around a payload already in place, and send the frame
+
+{
+    _binPut(f, BINLOG_SYNC >> 8, 1);
+    _binPut(f + 1, BINLOG_SYNC, 1);
+    f[2] = type;
+    _binPut(f + 3, frame, 2);
+    _binPut(f + 5, len, 2);
+    _binPut(f + BINLOG_HEADER_LEN + len, dcrc32(0, f + 2, BINLOG_HEADER_LEN - 2 + len), BINLOG_CRC_LEN);
+    uartSend((char *) f, BINLOG_HEADER_LEN + len + BINLOG_CRC_LEN);
+}
+// ============================================================================================
+static void _binCursor(uint8_t *f, uint32_t cursor, BOOL lost, uint32_t frame)
+
+// Send a cursor frame, saying if the one asked for had gone
+
+{
+    _binPut(f + BINLOG_HEADER_LEN, cursor, 4);
+    f[BINLOG_HEADER_LEN + 4] = lost;
+    _binFrame(f, BINLOG_CURSOR, frame, 5);
+}
+// ============================================================================================
+static BOOL _binStream(uint8_t *f, uint8_t type, logIterator *n, nvIterator *v, uint32_t first,
+                       uint32_t frames, uint32_t *frame)
+
+// Send frames of words or records, numbered from where the iterator starts, leaving out those
+// before first and stopping after frames of them. Returns TRUE if the store ran out, with the
+// number of the frame that would have come next.
+
+{
+    uint32_t sent = 0, len = BINLOG_PAYLOAD, got;
+
+    *frame = 0;
+
+    // A short frame means the store has run out
+    while ((len == BINLOG_PAYLOAD) && (sent < frames))
+        {
+            len = 0;
+            while ((len < BINLOG_PAYLOAD) && (got = _binItem(n, v, f + BINLOG_HEADER_LEN + len)))
+                len += got;
+
+            if (!len) break;
+            if (*frame >= first)
+                {
+                    _binFrame(f, type, *frame, len);
+                    sent++;
+                }
+            (*frame)++;
+        }
+    return (len < BINLOG_PAYLOAD);
+}
+// ============================================================================================
+static void _binRaw(uint8_t *f, char *cursor, uint32_t first, uint32_t frames)
+
+// Binlog of the raw words, from the store cursor given if it's still good
+
+{
+    uint32_t frame;
+    nvIterator v;
+    BOOL lost = FALSE;
+
+    nvInitIterator(&v);
+    if ((cursor) && (!nvGotoCursor(&v, _datoi(cursor)))) lost = TRUE;
+    _binCursor(f, nvCursor(&v), lost, 0);
+
+    f[BINLOG_HEADER_LEN] = _binStream(f, BINLOG_WORDS, NULL, &v, first, frames, &frame);
+    _binFrame(f, BINLOG_END, frame, 1);
+}
+// ============================================================================================
+static void _binRecords(uint8_t *f, char *cursor, uint32_t first, uint32_t frames)
+
+// Binlog of the decoded records, from the log numbered by the cursor given if it's still there
+
+{
+    uint32_t frame, logNum;
+    logIterator n;
+    BOOL lost = FALSE;
+
+    logInitIterator(&n);
+    if (cursor)
+        {
+            logNum = _datoi(cursor);
+            if ((!logGotoLog(&n, logNum)) || (logCurrentLog(&n) != logNum))
+                {
+                    lost = TRUE;
+                    logInitIterator(&n);
+                }
+        }
+    _binCursor(f, logCurrentLog(&n), lost, 0);
+
+    f[BINLOG_HEADER_LEN] = _binStream(f, BINLOG_RECORDS, &n, NULL, first, frames, &frame);
+    _binFrame(f, BINLOG_END, frame, 1);
+}
+// ============================================================================================
+COMMAND(_binlog)
+
+// Send the whole store, as raw words or decoded records, in checked binary frames. Frames are
+// numbered from where the dump starts, so a host can ask again for just the ones that arrived
+// damaged by giving the first frame wanted and how many. The oldest data can be dropped in
+// between, so a cursor frame goes first with where that was: a store cursor for words, the log
+// number for records. Handing it back with the retry numbers the frames from there again, or if
+// it's gone they're numbered from the oldest data and the cursor frame says so. An end frame
+// follows the last one sent. Each kind has its own routine, so only one iterator is on the stack.
+
+{
+    uint8_t f[BINLOG_HEADER_LEN + BINLOG_PAYLOAD + BINLOG_CRC_LEN];
+    uint32_t first = 0, frames = 0xFFFFFFFF;
+    char *cursor = NULL;
+
+    if ((nparams < 2) || (nparams > 5)) return FALSE;
+
+    if (nparams >= 3) first = _datoi(param[2]);
+    if (nparams >= 4) frames = _datoi(param[3]);
+    if (nparams == 5) cursor = param[4];
+
+    if (!_dstrcasecmp(param[1], "RAW")) _binRaw(f, cursor, first, frames);
+    else if (!_dstrcasecmp(param[1], "RECORDS")) _binRecords(f, cursor, first, frames);
+    else
+        return FALSE;
+    return TRUE;
+}
+// ============================================================================================
+COMMAND(_synclog)
+
+// Send the raw words written since a cursor from an earlier Synclog, or everything if there's no
+// cursor, framed as for Binlog. A cursor frame, giving the cursor to use next time, goes ahead
+// of the end frame. If the words at the old cursor have gone the oldest are sent instead, and the
+// cursor frame says so.
+
+{
+    uint8_t f[BINLOG_HEADER_LEN + BINLOG_PAYLOAD + BINLOG_CRC_LEN];
+    uint32_t first = 0, frames = 0xFFFFFFFF, frame;
+    nvIterator v;
+    BOOL lost = FALSE, ranOut;
+
+    if (nparams > 4) return FALSE;
+
+    nvInitIterator(&v);
+    if ((nparams >= 2) && (!nvGotoCursor(&v, _datoi(param[1])))) lost = TRUE;
+    if (nparams >= 3) first = _datoi(param[2]);
+    if (nparams == 4) frames = _datoi(param[3]);
+
+    ranOut = _binStream(f, BINLOG_WORDS, NULL, &v, first, frames, &frame);
+
+    _binCursor(f, nvCursor(&v), lost, frame);
+
+    f[BINLOG_HEADER_LEN] = ranOut;
+    _binFrame(f, BINLOG_END, frame, 1);
     return TRUE;
 }
 // ============================================================================================
@@ -673,8 +1034,9 @@ COMMAND(_help);     // A bit chicken and egg :-)
 static const _commandList commands[] =
 {
     { "+CONNECTED", 1, &_connected },
+    { "Binlog", VARPARAM, &_binlog },
     { "Commit", 1, &_commit },
-    { "Dumplog", 2, &_dumplog },
+    { "Dumplog", VARPARAM, &_dumplog },
     { "Dumpparam", 1, &_dumpparam },
     { "Flushlogs", 1, &_flushlogs },
     { "Help", 1, &_help },
@@ -689,6 +1051,8 @@ static const _commandList commands[] =
     { "Setparam", VARPARAM, _setparam },
     { "Setpoint", 2, _setpoint },
     { "Stop", 1, _stop },
+    { "Synclog", VARPARAM, _synclog },
+    { "Trace", 1, _trace },
     { "Uptime", 1, _uptime },
     { 0, 0, 0 }
 };
@@ -904,6 +1268,7 @@ void commandInit(void)
 {
     _doConnected();
     paramsModified = FALSE;
+    profilesDefaulted = FALSE;
     timerInit(&t);
     timerAdd(&t, TIMER_ORIGIN_COMMAND, 0, CL_REFRESH_INTERVAL);
 }
@@ -13,7 +13,9 @@ void denter_critical(void)
 // Enter a critical section, maintaining a depth count
 
 {
+#ifndef HOST_BUILD
     __disable_irq();
+#endif
     _critDepth++;
 }
 // ============================================================================================
@@ -24,6 +26,30 @@ void dleave_critical(void)
 {
     ASSERT(_critDepth);
     if (!--_critDepth)
-        __enable_irq();
+        {
+#ifndef HOST_BUILD
+            __enable_irq();
+#endif
+        }
+}
+// ============================================================================================
+uint32_t dcrc32(uint32_t crc, const void *data, uint32_t len)
+
+// Running CRC-32 (the IEEE 802.3 one) over a block of data. Pass 0 to start. This is done
+// bitwise as we can't spare the space for a table.
+
+{
+    const uint8_t *p=(const uint8_t *)data;
+    uint32_t bit;
+
+    crc=~crc;
+    while (len--)
+        {
+            crc^=*p++;
+            bit=8;
+            while (bit--)
+                crc=(crc>>1)^(0xEDB88320&(-(crc&1)));
+        }
+    return ~crc;
 }
 // ============================================================================================
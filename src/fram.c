@@ -0,0 +1,220 @@
+/*
+ * I2C driver for an external FRAM or EEPROM, used to hold the log when LOG_STORE_FRAM is defined.
+ * Transfers are short and polled. A FRAM writes at bus speed, while an EEPROM ignores its address
+ * until a page write has finished, so that case is covered by retrying the address.
+ */
+
+#include "config.h"
+#include "fram.h"
+
+#ifdef LOG_STORE_FRAM
+
+#ifndef I2C_SDA_PIN
+#error "I2C_SDA_PIN must be defined"
+#endif
+#ifndef I2C_SCL_PIN
+#error "I2C_SCL_PIN must be defined"
+#endif
+#ifndef FRAM_I2C_ADDR
+#error "FRAM_I2C_ADDR must be defined"
+#endif
+#ifndef FRAM_SIZE
+#error "FRAM_SIZE must be defined"
+#endif
+
+// Addresses go as two bytes. Bigger parts take the rest in the device address, in ways that vary
+// from part to part, so they aren't supported.
+#if FRAM_SIZE>0x10000
+#error "FRAM_SIZE too big for a two byte address"
+#endif
+
+#ifndef FRAM_PAGE_LEN
+#define FRAM_PAGE_LEN        FRAM_SIZE
+#endif
+#ifndef FRAM_I2C_BITRATE
+#define FRAM_I2C_BITRATE     400000
+#endif
+
+#define FRAM_SPIN_LIMIT      10000      // Polls of the bus before giving up on it
+#define FRAM_ADDR_TRIES      1000       // Attempts at addressing a device that's busy writing
+
+// Register bits used from the I2C block
+#define I2C_CFG_MSTEN        (1<<0)
+#define I2C_STAT_MSTPENDING  (1<<0)
+#define I2C_STAT_MSTSTATE    (7<<1)
+#define I2C_MSTSTATE_IDLE    (0<<1)
+#define I2C_MSTSTATE_RXREADY (1<<1)
+#define I2C_MSTSTATE_TXREADY (2<<1)
+#define I2C_MSTCTL_CONTINUE  (1<<0)
+#define I2C_MSTCTL_START     (1<<1)
+#define I2C_MSTCTL_STOP      (1<<2)
+
+// ============================================================================================
+BOOL _waitState(uint32_t state)
+
+// Wait for the bus master to need attention, and check it's in the state expected
+
+{
+    uint32_t spin=FRAM_SPIN_LIMIT;
+
+    while ((!(LPC_I2C->STAT&I2C_STAT_MSTPENDING)) && (--spin));
+    return (spin) && ((LPC_I2C->STAT&I2C_STAT_MSTSTATE)==state);
+}
+// ============================================================================================
+void _stop(void)
+
+// Finish a transfer and release the bus
+
+{
+    LPC_I2C->MSTCTL=I2C_MSTCTL_STOP;
+    _waitState(I2C_MSTSTATE_IDLE);
+}
+// ============================================================================================
+BOOL _send(uint32_t b)
+
+// Send a byte, returning FALSE if it wasn't acknowledged
+
+{
+    LPC_I2C->MSTDAT=b;
+    LPC_I2C->MSTCTL=I2C_MSTCTL_CONTINUE;
+    return _waitState(I2C_MSTSTATE_TXREADY);
+}
+// ============================================================================================
+BOOL _start(void)
+
+// Address the device for writing, returning FALSE if it doesn't answer, as an EEPROM won't
+// while it's busy
+
+{
+    LPC_I2C->MSTDAT=FRAM_I2C_ADDR<<1;
+    LPC_I2C->MSTCTL=I2C_MSTCTL_START;
+    return _waitState(I2C_MSTSTATE_TXREADY);
+}
+// ============================================================================================
+BOOL _address(uint32_t addr)
+
+// Start a transfer at addr in the device, retrying while it's busy. addr is below 0x10000.
+
+{
+    uint32_t tries=FRAM_ADDR_TRIES;
+
+    while (tries--)
+        {
+            if (_start())
+                return (_send(addr>>8) && _send(addr&0xFF));
+            _stop();
+        }
+    return FALSE;
+}
+// ============================================================================================
+// ============================================================================================
+// ============================================================================================
+// Externally available routines
+// ============================================================================================
+// ============================================================================================
+// ============================================================================================
+BOOL framRead(uint32_t addr, void *data, uint32_t len)
+
+// Read len bytes from addr in the device
+
+{
+    uint8_t *d=(uint8_t *)data;
+    BOOL retVal;
+
+    if (!len) return TRUE;
+
+    denter_critical();
+    if ((retVal=_address(addr)))
+        {
+            // Repeated start to turn the bus round, then clock the data in
+            LPC_I2C->MSTDAT=(FRAM_I2C_ADDR<<1)|1;
+            LPC_I2C->MSTCTL=I2C_MSTCTL_START;
+            retVal=_waitState(I2C_MSTSTATE_RXREADY);
+            while (retVal)
+                {
+                    *d++=LPC_I2C->MSTDAT;
+                    if (!--len) break;
+                    LPC_I2C->MSTCTL=I2C_MSTCTL_CONTINUE;
+                    retVal=_waitState(I2C_MSTSTATE_RXREADY);
+                }
+        }
+
+    // Stopping rather than continuing after the last byte NACKs it, ending the read
+    _stop();
+    dleave_critical();
+    return retVal;
+}
+// ============================================================================================
+BOOL framWrite(uint32_t addr, const void *data, uint32_t len)
+
+// Write len bytes to addr in the device, split so no write crosses a page boundary
+
+{
+    const uint8_t *d=(const uint8_t *)data;
+    uint32_t chunk;
+    BOOL retVal=TRUE;
+
+    while ((len) && (retVal))
+        {
+            chunk=FRAM_PAGE_LEN-(addr%FRAM_PAGE_LEN);
+            if (chunk>len) chunk=len;
+            addr+=chunk;
+            len-=chunk;
+
+            denter_critical();
+            retVal=_address(addr-chunk);
+            while ((retVal) && (chunk--))
+                retVal=_send(*d++);
+            _stop();
+            dleave_critical();
+        }
+    return retVal;
+}
+// ============================================================================================
+BOOL framWait(void)
+
+// Wait for the device to answer, as an EEPROM won't while it's finishing a write. Interrupts are
+// only held off for each try, so they aren't kept waiting for the whole write.
+
+{
+    uint32_t tries=FRAM_ADDR_TRIES;
+    BOOL retVal=FALSE;
+
+    while ((!retVal) && (tries--))
+        {
+            denter_critical();
+            retVal=_start();
+            _stop();
+            dleave_critical();
+        }
+    return retVal;
+}
+// ============================================================================================
+BOOL framInit(void)
+
+// Initialise the I2C bus and check the device is there
+
+{
+    BOOL retVal;
+
+    LPC_SYSCON->SYSAHBCLKCTRL |= (1<<5);    // Enable I2C
+    LPC_SYSCON->PRESETCTRL &= ~(1<<6);
+    LPC_SYSCON->PRESETCTRL |= (1<<6);       // Reset I2C
+
+    LPC_SWM->PINASSIGN7=(LPC_SWM->PINASSIGN7&0x00FFFFFF)|(I2C_SDA_PIN<<24);
+    LPC_SWM->PINASSIGN8=(LPC_SWM->PINASSIGN8&0xFFFFFF00)|I2C_SCL_PIN;
+
+    // Two clocks low and two high for each bit, so divide down to four times the bitrate
+    LPC_I2C->DIV=(SystemCoreClock+FRAM_I2C_BITRATE*4-1)/(FRAM_I2C_BITRATE*4)-1;
+    LPC_I2C->MSTTIME=0;
+    LPC_I2C->CFG=I2C_CFG_MSTEN;
+
+    // See if anything answers
+    denter_critical();
+    retVal=_address(0);
+    _stop();
+    dleave_critical();
+    return retVal;
+}
+// ============================================================================================
+#endif
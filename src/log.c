@@ -4,114 +4,756 @@
  *
  * Uses an iterator which returns the next uint32 from the data store (or puts it there).
  *
+ * Records are packed into words without crossing from one to the next, and the top bit of every
+ * word is kept clear so data can never look like empty store or a session marker. Any word can
+ * therefore be decoded on its own, so a damaged word only loses the records it holds.
  */
 
+#include <stddef.h>
+#include "dutils.h"
 #include "log.h"
 #include "nv.h"
 
 static uint32_t numLogs;      // Number of distinct logs
 static uint32_t bitStream;    // The bits being written to file
 static uint32_t bitStreamLen; // How many of them we've got
-static uint32_t bitOneCount;  // How many 1's have we got - do we need to bit-stuff?
+static uint32_t lastTemp;     // The last temperature written...
+static uint32_t deltasLeft;   // ...and how many changes can follow it before the full value is due
+static uint32_t repeats;      // Readings the same as it, not yet written
+static BOOL powerFailing;     // In the brownout interrupt, with no time to make room in the store
+static uint32_t recordInterval; // Time between readings, last one logged
+static logSummaryType current;  // Summary of the log being written, in the units it's stored in
+static uint32_t carriedValue[LOG_CHECKPOINT_STATE_LEN]; // Last value of each repeated at checkpoints...
+static BOOL haveCarried;        // ...if any of them has been written
+static uint32_t nextCheckpoint; // Time into the log when the next checkpoint is due...
+static uint32_t wordsSinceCheckpoint; // ...once there's been enough written since the last
+static nvIterator logStart;     // Where the log being written starts
+static uint8_t selected[LOG_MAX_VARIABLES]=LOG_SELECT_DEFAULT; // One in how many of each variable to log from the next log...
+static uint8_t logEvery[LOG_MAX_VARIABLES]; // ...and in the one being written...
+static uint8_t skipCount[LOG_MAX_VARIABLES]; // ...with how many more to skip before the next goes in
+
+// Where the most recent logs start, with a logNum of 0 for an unused entry
+static struct
+{
+    uint32_t logNum;
+    uint32_t *start;            // The store position, as nvIterator rp
+} sessionIndex[LOG_INDEX_LEN];
+static BOOL indexBuilt;         // ...and if the store has been walked back to fill it
 
-// Defines used for bit stuffing and variable masking
-#define MAX_ONES 30
+// Defines used for word framing and variable masking
 #define MAX_BITS 32
+#define LOG_GUARD_BIT          0x80000000                   // Always clear in a data word...
+#define LOG_PAYLOAD_BITS       (MAX_BITS-1)                 // ...leaving this many for records
 #define LOG_ELEMENT_BITS_MASK  ((1<<LOG_ELEMENT_BITS)-1)
+#define LOG_PAD                LOG_ELEMENT_BITS_MASK        // Variable that ends the records in a word
 
-// Special value to indicate a new session.
+// Special value to indicate a new session. It is followed by a word holding the session number
+// so the count can be recovered from the end of the store without replaying all of it.
 #define LOG_SESSION_START 0xFFFFFFFE
 
+// Special value to mark the summary of a session, written as it's closed. It is followed by
+// LOG_SUMMARY_WORDS words with the top bit clear; the number of entries, the duration, then
+// the lowest and highest temperatures and the profile packed together.
+#define LOG_SESSION_SUMMARY    0xFFFFFFFD
+#define LOG_SUMMARY_WORDS      3
+#define LOG_SUMMARY_TEMP_BITS  12
+#define LOG_SUMMARY_TEMP_MASK  ((1<<LOG_SUMMARY_TEMP_BITS)-1)
+
+// Special value to mark a checkpoint. It is followed by a word holding the seconds into the
+// session, then one with the last value of each of LOG_CHECKPOINT_STATE, or LOG_NO_VALUE if
+// there hasn't been one. The temperature after it is always a full value.
+#define LOG_CHECKPOINT         0xFFFFFFFC
+#define LOG_CHECKPOINT_WORDS   (1+LOG_CHECKPOINT_STATE_LEN)
+#define LOG_NO_VALUE           0x7FFFFFFF
+
+// Special value to mark a block record, one that's too big to be packed with the others. It's
+// followed by a header word with the variable in the top bits, then the value, then the number
+// of words of the block that follow, each with the top bit clear.
+#define LOG_BLOCK              0xFFFFFFFB
+#define LOG_BLOCK_VAR_SHIFT    27
+#define LOG_BLOCK_VALUE_SHIFT  16
+#define LOG_BLOCK_VALUE_MASK   ((1<<(LOG_BLOCK_VAR_SHIFT-LOG_BLOCK_VALUE_SHIFT))-1)
+#define LOG_BLOCK_LEN_MASK     ((1<<LOG_BLOCK_VALUE_SHIFT)-1)
+
+// Special value to mark where the power failed. The word before it was committed early, padded
+// out, so nothing logged was lost. It reads back as a LOG_BOD_TRIGGERED record.
+#define LOG_POWER_FAIL         0xFFFFFFFA
+#define LOG_FIRST_MARKER       LOG_POWER_FAIL               // Words from here up are all markers
+
+// Fewest repeated temperatures worth a LOG_TEMPERATURE_REPEAT rather than changes of nothing
+#define LOG_REPEAT_MIN         3
+
+// Each log starts with a LOG_SCHEMA block holding a word for each variable logged in it; the
+// number, its width, units, one in how many are logged and the scale. Logs are decoded from that,
+// so they still read back after the variables have changed.
+#define LOG_SCHEMA_WIDTH_SHIFT 4
+#define LOG_SCHEMA_WIDTH_MASK  0x1F
+#define LOG_SCHEMA_UNIT_SHIFT  9
+#define LOG_SCHEMA_UNIT_MASK   0x07
+#define LOG_SCHEMA_EVERY_SHIFT 12
+#define LOG_SCHEMA_EVERY_MASK  0xFF
+#define LOG_SCHEMA_SCALE_SHIFT 20
+#define LOG_SCHEMA_SCALE_MASK  0x7FF
+#define LOG_WIDTH_UNKNOWN      0xFF     // Width of a variable that's not described, never fits
+
 // ... the names of the variables, populated from the LOG_BITS define
 static const struct
 {
     uint32_t length;
     uint32_t scale;
-    char *units;
+    uint32_t unit;
     char *name;
 } vardesc[]= { LOG_BITS };
 
+#define NUM_VARIABLES (sizeof(vardesc)/sizeof(vardesc[0]))
+
+// ... and what they're measured in
+static const char * const units[]= { LOG_UNITS };
+
+#define NUM_UNITS (sizeof(units)/sizeof(units[0]))
+
+// ... and the variables repeated at checkpoints
+static const uint32_t carriedVars[LOG_CHECKPOINT_STATE_LEN]= { LOG_CHECKPOINT_STATE };
+
+// Codes for changes in temperature, most likely first. The change is folded into a positive
+// number (0, -1, 1, -2, 2...) and each code covers the next range of those after the one before,
+// so no change at all takes one bit and anything up to 7.4°C takes ten.
+static const struct
+{
+    uint32_t prefix;
+    uint32_t prefixLen;
+    uint32_t len;
+} deltaCode[]= { {0, 1, 0}, {2, 2, 2}, {6, 3, 4}, {7, 3, 7} };
+
+#define NUM_DELTA_CODES (sizeof(deltaCode)/sizeof(deltaCode[0]))
+
+// ============================================================================================
+uint32_t _reverse(uint32_t x)
+
+// Reverse the order of the bits in a word. The M0+ has no instruction for this.
+
+{
+    x=((x>>1)&0x55555555)|((x&0x55555555)<<1);
+    x=((x>>2)&0x33333333)|((x&0x33333333)<<2);
+    x=((x>>4)&0x0F0F0F0F)|((x&0x0F0F0F0F)<<4);
+    x=((x>>8)&0x00FF00FF)|((x&0x00FF00FF)<<8);
+    return (x>>16)|(x<<16);
+}
+// ============================================================================================
+BOOL _commitWord(void)
+
+// Send the word being built to the store. Any space left over is filled with ones, which reads
+// as LOG_PAD, and is what's left in erased flash anyway. The brownout interrupt commits the
+// word too, so it's taken with interrupts off, but room is made in the store beforehand so
+// that handing it over never waits on the store.
+
+{
+    uint32_t w;
+    BOOL retVal;
+
+    if (!bitStreamLen) return TRUE;
+
+    retVal=(powerFailing) || (nvMakeRoom());
+
+    denter_critical();
+    if (bitStreamLen)
+        {
+            w=(bitStream|(0xFFFFFFFF<<bitStreamLen))&~LOG_GUARD_BIT;
+            bitStream=0;
+            bitStreamLen=0;
+            wordsSinceCheckpoint++;
+            retVal=nvAppend(w) && retVal;
+        }
+    dleave_critical();
+    return retVal;
+}
+// ============================================================================================
+BOOL _pack(uint32_t field, uint32_t len)
+
+// Write a field of len bits, most significant first, starting a new word if it won't fit in
+// this one. The bits go in first to last from bit 0, so the field is reversed as it goes in.
+
+{
+    BOOL retVal=TRUE;
+    BOOL full;
+
+    ASSERT((len) && (len<=LOG_PAYLOAD_BITS));
+
+    if (bitStreamLen+len>LOG_PAYLOAD_BITS)
+        retVal=_commitWord();
+
+    // A whole field goes in at once, so the brownout interrupt never commits part of one
+    denter_critical();
+    bitStream|=(_reverse(field)>>(MAX_BITS-len))<<bitStreamLen;
+    bitStreamLen+=len;
+    full=(bitStreamLen==LOG_PAYLOAD_BITS);
+    dleave_critical();
+
+    if (full)
+        retVal&=_commitWord();
+
+    return retVal;
+}
 // ============================================================================================
-BOOL _pump(BOOL x)
+BOOL _packDelta(uint32_t value, uint32_t *field, uint32_t *len)
 
-// Internal bit pump for entries, includes bit-stuffer to avoid false end-of-data markers
+// Build the field for a change in temperature, returning FALSE if it's too big for any code
 
 {
-    if (x)
+    int32_t delta=value-lastTemp;
+    uint32_t z=(delta<0)?((-delta)<<1)-1:delta<<1;
+    uint32_t c=0;
+
+    while (c<NUM_DELTA_CODES)
         {
-            if (bitOneCount++==MAX_ONES)
+            if (z<(1u<<deltaCode[c].len))
                 {
-                    // Too many 1's in a row - force a zero in there
-                    bitOneCount=0;
-                    _pump(0);
+                    *field=(deltaCode[c].prefix<<deltaCode[c].len)|z;
+                    *len=deltaCode[c].prefixLen+deltaCode[c].len;
+                    return TRUE;
                 }
+            z-=1<<deltaCode[c].len;
+            c++;
         }
-    else
-        bitOneCount=0;
+    return FALSE;
+}
+// ============================================================================================
+BOOL _flushRepeats(void)
+
+// Write the readings held back as being the same as the last temperature. A run of them goes
+// as a LOG_TEMPERATURE_REPEAT, which counts as a change, but one or two are cheaper as changes
+// of nothing.
+
+{
+    uint32_t field, len, count;
+    BOOL retVal=TRUE;
 
-    bitStream=(bitStream>>1)|(x?0x80000000:0);
-    bitStreamLen++;
+    // Take the run with interrupts off, so it can only be written once
+    denter_critical();
+    count=repeats;
+    repeats=0;
+    if ((count) && (deltasLeft)) deltasLeft--;
+    dleave_critical();
 
-    if (bitStreamLen==MAX_BITS)
+    if (!count) return TRUE;
+
+    if (count>=LOG_REPEAT_MIN)
         {
-            bitStreamLen=0;
-            return nvWrite_entry(bitStream);
+            retVal=_pack((LOG_TEMPERATURE_REPEAT<<vardesc[LOG_TEMPERATURE_REPEAT].length)|count,
+                         LOG_ELEMENT_BITS+vardesc[LOG_TEMPERATURE_REPEAT].length);
+            count=0;
+        }
+
+    while (count)
+        {
+            _packDelta(lastTemp, &field, &len);
+            retVal&=_pack((LOG_TEMPERATURE_DELTA<<len)|field, LOG_ELEMENT_BITS+len);
+            count--;
+        }
+    return retVal;
+}
+// ============================================================================================
+void _schemaDefaults(logIterator *n)
+
+// Take the variables to be as they're built in, until a schema says otherwise
+
+{
+    uint32_t i=0;
+
+    while (i<LOG_MAX_VARIABLES)
+        {
+            n->width[i]=(i<NUM_VARIABLES)?vardesc[i].length:LOG_WIDTH_UNKNOWN;
+            n->unit[i]=(i<NUM_VARIABLES)?vardesc[i].unit:LOG_UNIT_NONE;
+            n->scale[i]=(i<NUM_VARIABLES)?vardesc[i].scale:1;
+            i++;
+        }
+}
+// ============================================================================================
+void _newSession(logIterator *n)
+
+// A session marker has been read - pick up the session number
+
+{
+    n->currentLog=nvIteratorNext(&n->nv);
+    if (n->currentLog==NV_EMPTY)
+        n->state=LOG_ENDSTATE;
+    _schemaDefaults(n);
+    n->haveTemp=FALSE;
+    n->time=0;
+    n->interval=0;
+    n->carriedNext=LOG_CHECKPOINT_STATE_LEN;
+    n->carry=TRUE;
+    n->blockPending=FALSE;
+    n->powerFail=FALSE;
+    n->repeatsLeft=0;
+}
+// ============================================================================================
+BOOL _readWords(nvIterator *nv, uint32_t *w, uint32_t count)
+
+// Read the words that follow a marker. Returns FALSE if any are damaged, or if they were cut
+// short, when whatever's there instead is left to be read.
+
+{
+    nvIterator p;
+    uint32_t i=0;
+    BOOL retVal=TRUE;
+
+    while (i<count)
+        {
+            p=*nv;
+            w[i]=nvIteratorNext(&p);
+            if (w[i]>=LOG_FIRST_MARKER) return FALSE;
+            *nv=p;
+            if (w[i++]&LOG_GUARD_BIT) retVal=FALSE;
+        }
+    return retVal;
+}
+// ============================================================================================
+BOOL _readSummary(nvIterator *nv, logSummaryType *s)
+
+// Read the summary that follows its marker into s, if it's wanted
+
+{
+    uint32_t w[LOG_SUMMARY_WORDS];
+
+    if (!_readWords(nv, w, LOG_SUMMARY_WORDS)) return FALSE;
+
+    if (s)
+        {
+            s->entries=w[0];
+            s->duration=w[1];
+            s->minTemp=w[2]&LOG_SUMMARY_TEMP_MASK;
+            s->maxTemp=(w[2]>>LOG_SUMMARY_TEMP_BITS)&LOG_SUMMARY_TEMP_MASK;
+            s->profile=w[2]>>(2*LOG_SUMMARY_TEMP_BITS);
         }
     return TRUE;
 }
 // ============================================================================================
-void _getNext(logIterator *n)
+BOOL _readCheckpoint(logIterator *n)
 
-// Get next uint32 from the underlying non-volatile storage
+// Read the checkpoint that follows its marker, picking up the time from it. If nothing has been
+// handed out from this part of the log yet then the values it repeats are queued up to go first.
 
 {
-    n->bitsAvail=MAX_BITS;
-    n->readVal=nvIteratorNext(&n->nv);
+    uint32_t w[LOG_CHECKPOINT_WORDS];
+    uint32_t i=0;
+
+    if (!_readWords(&n->nv, w, LOG_CHECKPOINT_WORDS)) return FALSE;
 
-    switch (n->readVal)
+    n->time=w[0];
+    if (n->carry)
         {
-            case NV_EMPTY:
+            while (i<LOG_CHECKPOINT_STATE_LEN)
+                {
+                    n->carried[i]=w[i+1];
+                    i++;
+                }
+            n->carriedNext=0;
+            n->carry=FALSE;
+        }
+    return TRUE;
+}
+// ============================================================================================
+void _readBlock(logIterator *n)
+
+// Read the block that follows its marker, noting where its words are so they can be read later,
+// and queue it up to be handed out as a record if it's all there. A schema is taken up straight
+// away instead, whatever part of it is undamaged.
+
+{
+    uint32_t w, v;
+    uint32_t len;
+    BOOL isSchema;
+
+    if (!_readWords(&n->nv, &n->blockHeader, 1)) return;
+
+    n->block=n->nv;
+    len=n->blockHeader&LOG_BLOCK_LEN_MASK;
+    isSchema=((n->blockHeader>>LOG_BLOCK_VAR_SHIFT)==LOG_SCHEMA);
+    while (len--)
+        {
+            if (!_readWords(&n->nv, &w, 1))
+                {
+                    // Only give up on a schema if it's been cut short
+                    if ((!isSchema) || (w>=LOG_FIRST_MARKER)) return;
+                }
+            else if ((isSchema) && ((v=w&LOG_ELEMENT_BITS_MASK)<LOG_MAX_VARIABLES))
+                {
+                    n->width[v]=(w>>LOG_SCHEMA_WIDTH_SHIFT)&LOG_SCHEMA_WIDTH_MASK;
+                    n->unit[v]=(w>>LOG_SCHEMA_UNIT_SHIFT)&LOG_SCHEMA_UNIT_MASK;
+                    n->scale[v]=(w>>LOG_SCHEMA_SCALE_SHIFT)&LOG_SCHEMA_SCALE_MASK;
+                }
+        }
+
+    n->blockPending=!isSchema;
+}
+// ============================================================================================
+void _fill(logIterator *n)
+
+// Load the next data word from the underlying non-volatile storage, moving on to the next
+// session or to the end of the log as they're reached
+
+{
+    uint32_t readVal;
+
+    n->windowLen=0;
+    while ((n->state==LOG_OK) && (!n->windowLen) && (!n->blockPending) && (!n->powerFail))
+        {
+            readVal=nvIteratorNext(&n->nv);
+            if (readVal==NV_EMPTY)
                 n->state=LOG_ENDSTATE;
-                return;
+            else if (readVal==LOG_SESSION_START)
+                _newSession(n);
+            else if (readVal==LOG_SESSION_SUMMARY)
+                _readSummary(&n->nv, NULL);
+            else if (readVal==LOG_CHECKPOINT)
+                _readCheckpoint(n);
+            else if (readVal==LOG_BLOCK)
+                _readBlock(n);
+            else if (readVal==LOG_POWER_FAIL)
+                n->powerFail=TRUE;
+            else if (readVal&LOG_GUARD_BIT)
+                {
+                    // Not something we wrote, so the changes that follow can't be trusted
+                    n->badWords++;
+                    n->haveTemp=FALSE;
+                }
+            else
+                {
+                    n->window=readVal;
+                    n->windowLen=LOG_PAYLOAD_BITS;
+                }
+        }
+}
+// ============================================================================================
+BOOL _take(logIterator *n, uint32_t len, uint32_t *field)
 
-            case LOG_SESSION_START:
-                n->currentLog++;
-                n->bitOneCount=0;
-                _getNext(n);
-                break;
+// Take a field of len bits from the word, most significant first, if there are enough left
 
-            default:
-                break;
+{
+    if (len>n->windowLen) return FALSE;
+
+    *field=len?_reverse(n->window)>>(MAX_BITS-len):0;
+    n->window>>=len;
+    n->windowLen-=len;
+    return TRUE;
+}
+// ============================================================================================
+BOOL _takeDelta(logIterator *n, uint32_t *delta)
+
+// Take a change in temperature from the word
+
+{
+    uint32_t code=0, codeLen=0;
+    uint32_t c=0;
+    uint32_t z=0;
+    uint32_t b;
+
+    // The codes are in order of length and none starts with another, so take bits until one fits
+    while (c<NUM_DELTA_CODES)
+        {
+            while (codeLen<deltaCode[c].prefixLen)
+                {
+                    if (!_take(n, 1, &b)) return FALSE;
+                    code=(code<<1)|b;
+                    codeLen++;
+                }
+            if (code==deltaCode[c].prefix) break;
+            z+=1<<deltaCode[c].len;
+            c++;
         }
-}// ============================================================================================
-BOOL _unpump(logIterator *n)
 
-// Pull bit from the linear store, removing bit-stuffing as nessessary.
+    if ((c==NUM_DELTA_CODES) || (!_take(n, deltaCode[c].len, &b))) return FALSE;
+    z+=b;
+    *delta=(z&1)?-((z+1)>>1):(z>>1);
+    return TRUE;
+}
+// ============================================================================================
+void _summaryStart(logSummaryType *s, uint32_t logNum)
+
+// Start a summary for a log with nothing in it yet
 
 {
-    BOOL retVal;
+    s->logNum=logNum;
+    s->entries=0;
+    s->duration=0;
+    s->minTemp=LOG_SUMMARY_TEMP_MASK;
+    s->maxTemp=0;
+    s->profile=LOG_NO_PROFILE;
+}
+// ============================================================================================
+void _account(logSummaryType *s, uint32_t *interval, uint32_t variable, uint32_t value)
 
-    retVal=n->readVal&1;
+// Add a record, in the units it's stored in, to a summary. Each temperature reading covers the
+// record interval last logged, which is kept in interval.
 
-    // Make sure we don't need to get another uint32
-    if ((!--n->bitsAvail) && (n->state==LOG_OK))
-        _getNext(n);
-    else
-        n->readVal>>=1;
+{
+    s->entries++;
+    if (variable==LOG_RECORD_INTERVAL)
+        *interval=value;
+    else if (variable==LOG_TEMPERATURE)
+        s->duration+=*interval;
+
+    if ((variable==LOG_TEMPERATURE) || (variable==LOG_TEMPERATURE_MIN) || (variable==LOG_TEMPERATURE_MAX))
+        {
+            if (value<s->minTemp) s->minTemp=value;
+            if (value>s->maxTemp) s->maxTemp=value;
+        }
+}
+// ============================================================================================
+BOOL _writeSummary(void)
+
+// Write the summary of the log being closed, if it's got anything in it
+
+{
+    ASSERT(vardesc[LOG_TEMPERATURE].length<=LOG_SUMMARY_TEMP_BITS);
+
+    if (!current.entries) return TRUE;
+
+    return nvWrite_entry(LOG_SESSION_SUMMARY) && nvWrite_entry(current.entries&~LOG_GUARD_BIT)
+           && nvWrite_entry(current.duration&~LOG_GUARD_BIT)
+           && nvWrite_entry(current.minTemp|(current.maxTemp<<LOG_SUMMARY_TEMP_BITS)
+                            |(current.profile<<(2*LOG_SUMMARY_TEMP_BITS)));
+}
+// ============================================================================================
+BOOL _writeCheckpoint(void)
+
+// Write the time into the log and the values to be repeated, and make the next temperature a
+// full value, so reading can start from here
+
+{
+    BOOL retVal=_flushRepeats() && _commitWord() && nvWrite_entry(LOG_CHECKPOINT)
+                && nvWrite_entry(current.duration&~LOG_GUARD_BIT);
+    uint32_t i=0;
+
+    while (i<LOG_CHECKPOINT_STATE_LEN)
+        retVal&=nvWrite_entry(carriedValue[i++]);
+
+    deltasLeft=0;
+    wordsSinceCheckpoint=0;
+    // A stretched record interval stretches the gap too, so checkpoints don't outweigh readings
+    nextCheckpoint=current.duration+((recordInterval*LOG_CHECKPOINT_READINGS>LOG_CHECKPOINT_INTERVAL)?
+                                     recordInterval*LOG_CHECKPOINT_READINGS:LOG_CHECKPOINT_INTERVAL);
+    return retVal;
+}
+// ============================================================================================
+BOOL _store(uint32_t w)
+
+// Hand a word to the store. While the power's failing there's no time for store work, so it just
+// goes in behind what's waiting.
+
+{
+    return (powerFailing)?nvAppend(w):nvWrite_entry(w);
+}
+// ============================================================================================
+BOOL _writeBlock(uint32_t variable, uint32_t value, const uint32_t *words, uint32_t count)
+
+// Write a block record. It goes in words of its own after the marker and the header.
+
+{
+    BOOL retVal=_flushRepeats() && _commitWord() && _store(LOG_BLOCK)
+                && _store((variable<<LOG_BLOCK_VAR_SHIFT)|(value<<LOG_BLOCK_VALUE_SHIFT)|count);
+
+    while (count--)
+        retVal&=_store(*words++&~LOG_GUARD_BIT);
+    return retVal;
+}
+// ============================================================================================
+BOOL _writeSchema(void)
 
-    if (n->state!=LOG_OK)
-        return FALSE;
+// Make the selection of variables the one for the log being written, and describe those in it
 
-    // Check for bit-stuffing
-    if (retVal)
+{
+    uint32_t w[LOG_MAX_VARIABLES];
+    uint32_t i=0, count=0;
+
+    while (i<NUM_VARIABLES)
         {
-            if (++n->bitOneCount==MAX_ONES)
-                _unpump(n);  // Pull the next value
+            logEvery[i]=selected[i];
+            skipCount[i]=0;
+            if ((logEvery[i]) && (i!=LOG_SCHEMA))
+                w[count++]=i|(vardesc[i].length<<LOG_SCHEMA_WIDTH_SHIFT)|(vardesc[i].unit<<LOG_SCHEMA_UNIT_SHIFT)
+                           |(logEvery[i]<<LOG_SCHEMA_EVERY_SHIFT)|(vardesc[i].scale<<LOG_SCHEMA_SCALE_SHIFT);
+            i++;
+        }
+    return _writeBlock(LOG_SCHEMA, 0, w, count);
+}
+// ============================================================================================
+BOOL _due(uint32_t variable)
+
+// Return TRUE if this record of the variable is one to be logged
+
+{
+    if (!logEvery[variable]) return FALSE;
+
+    if (skipCount[variable])
+        {
+            skipCount[variable]--;
+            return FALSE;
+        }
+    skipCount[variable]=logEvery[variable]-1;
+    return TRUE;
+}
+// ============================================================================================
+BOOL _summarise(logIterator *n, logSummaryType *s)
+
+// Move n on to the start of the next log, filling in the summary of the one it's in on the way.
+// Returns TRUE if that was written in the store, otherwise it's worked out from the records.
+
+{
+    nvIterator next=n->nv;      // Runs on ahead to the start of the next log
+    uint32_t w[LOG_CHECKPOINT_WORDS];
+    uint32_t readVal;
+    uint32_t interval=0;
+    uint32_t badWords=n->badWords;
+    BOOL stored=FALSE;
+
+    _summaryStart(s, n->currentLog);
+
+    // Only the words need looking at to find the summary, not the records in them
+    while (((readVal=nvIteratorNext(&next))!=NV_EMPTY) && (readVal!=LOG_SESSION_START))
+        {
+            if (readVal==LOG_SESSION_SUMMARY)
+                stored|=_readSummary(&next, s);
+            else if (readVal==LOG_CHECKPOINT)
+                _readWords(&next, w, LOG_CHECKPOINT_WORDS);
+            else if ((readVal&LOG_GUARD_BIT) && (readVal!=LOG_BLOCK) && (readVal!=LOG_POWER_FAIL))
+                badWords++;
+        }
+
+    // The power went before it was closed, or the summary is damaged, so go through the records
+    if (!stored)
+        while ((logIteratorNext(n)) && (n->currentLog==s->logNum))
+            {
+                if (!n->isCarried)
+                    _account(s, &interval, n->variable, n->value);
+                else if (n->variable==LOG_RECORD_INTERVAL)
+                    interval=n->value;
+            }
+
+    // Either way n picks up from where the scan stopped, with the schema of the next log read
+    n->nv=next;
+    n->badWords=badWords;
+    n->blockPending=FALSE;
+    n->powerFail=FALSE;
+    n->state=LOG_OK;
+    if (readVal==LOG_SESSION_START)
+        {
+            _newSession(n);
+            _fill(n);
         }
     else
-        n->bitOneCount=0;
+        n->state=LOG_ENDSTATE;
+    return stored;
+}
+// ============================================================================================
+void _indexClear(void)
 
-    return retVal;
+// Forget where all the logs start
+
+{
+    uint32_t i=0;
+
+    while (i<LOG_INDEX_LEN)
+        sessionIndex[i++].logNum=0;
+}
+// ============================================================================================
+void _indexAdd(uint32_t logNum, nvIterator *start)
+
+// Remember where a log starts, in place of the oldest one remembered if there's no room
+
+{
+    uint32_t i=0, oldest=0;
+
+    while (i<LOG_INDEX_LEN)
+        {
+            if (sessionIndex[i].logNum==logNum) return;
+            if (sessionIndex[i].logNum<sessionIndex[oldest].logNum) oldest=i;
+            i++;
+        }
+
+    if (logNum>sessionIndex[oldest].logNum)
+        {
+            sessionIndex[oldest].logNum=logNum;
+            sessionIndex[oldest].start=start->rp;
+        }
+}
+// ============================================================================================
+BOOL _indexFind(uint32_t logNum, nvIterator *start)
+
+// Look up where a log starts. The store may have moved on since, so check it's still there.
+
+{
+    uint32_t i=0;
+    nvIterator n;
+
+    while ((i<LOG_INDEX_LEN) && (sessionIndex[i].logNum!=logNum)) i++;
+    if ((!logNum) || (i==LOG_INDEX_LEN)) return FALSE;
+
+    start->rp=sessionIndex[i].start;
+    start->state=NV_OK;
+    n=*start;
+    if ((nvIteratorNext(&n)!=LOG_SESSION_START) || (nvIteratorNext(&n)!=logNum))
+        {
+            sessionIndex[i].logNum=0;
+            return FALSE;
+        }
+    return TRUE;
+}
+// ============================================================================================
+uint32_t _lastSession(void)
+
+// Find the number of the last session by walking backwards from the end of the store, noting
+// where it starts
+
+{
+    nvIterator n;
+    uint32_t readVal;
+    uint32_t follow=NV_EMPTY;   // The word after the one just read
+    uint32_t unnumbered=0;      // Sessions found with their number missing
+
+    nvInitIteratorEnd(&n);
+    while (nvIteratorState(&n)==NV_OK)
+        {
+            readVal=nvIteratorPrev(&n);
+            if (readVal==LOG_SESSION_START)
+                {
+                    // If power went before the number was written then keep looking
+                    if (follow!=NV_EMPTY)
+                        {
+                            _indexAdd(follow, &n);
+                            return follow+unnumbered;
+                        }
+                    unnumbered++;
+                }
+            follow=readVal;
+        }
+    return unnumbered;
+}
+// ============================================================================================
+void _buildIndex(void)
+
+// Walk backwards from the end of the store, noting where the most recent logs start. This is
+// left until a log is looked for that isn't known, so starting up doesn't wait on it.
+
+{
+    nvIterator n;
+    uint32_t readVal;
+    uint32_t follow=NV_EMPTY;   // The word after the one just read
+    uint32_t found=0;
+
+    indexBuilt=TRUE;
+    nvInitIteratorEnd(&n);
+    while ((nvIteratorState(&n)==NV_OK) && (found<LOG_INDEX_LEN))
+        {
+            readVal=nvIteratorPrev(&n);
+            if ((readVal==LOG_SESSION_START) && (follow!=NV_EMPTY))
+                {
+                    _indexAdd(follow, &n);
+                    found++;
+                }
+            follow=readVal;
+        }
 }
 // ============================================================================================
 // ============================================================================================
@@ -126,11 +768,30 @@ void logInitIterator(logIterator *n)
 // Iterators cycle over the log data.  They are set to initial values here
 
 {
+    uint32_t readVal;
+
     nvInitIterator(&n->nv);     // Initialise the underlying store iterator
     n->currentLog=0;
     n->state=LOG_OK;
-    n->bitOneCount=0;
-    _getNext(n);                // Get the first data
+    n->windowLen=0;
+    n->badWords=0;
+    n->blockPending=FALSE;
+    n->powerFail=FALSE;
+
+    // Once the store has wrapped the oldest session has lost its start and can't be decoded,
+    // so skip forward to the first session that's complete
+    do
+        readVal=nvIteratorNext(&n->nv);
+    while ((readVal!=LOG_SESSION_START) && (readVal!=NV_EMPTY));
+
+    if (readVal==NV_EMPTY)
+        n->state=LOG_ENDSTATE;
+    else
+        {
+            // Take up its schema, so it's known what's in the log before any records are read
+            _newSession(n);
+            _fill(n);
+        }
 }
 // ============================================================================================
 BOOL logIteratorNext(logIterator *n)
@@ -138,31 +799,104 @@ BOOL logIteratorNext(logIterator *n)
 // Get the next element from the log
 
 {
-    uint32_t activeLog = n->currentLog;  // Keep this log in case it changes
-    n->variable=0;
-    n->value=0;
+    BOOL goodRecord;
 
-    uint32_t bitsToRead=LOG_ELEMENT_BITS;
+    while (n->state==LOG_OK)
+        {
+            // Values repeated by a checkpoint go before anything logged after it
+            if (n->carriedNext<LOG_CHECKPOINT_STATE_LEN)
+                {
+                    n->variable=carriedVars[n->carriedNext];
+                    n->value=n->carried[n->carriedNext++];
+                    if (n->value==LOG_NO_VALUE) continue;
+                    if (n->variable==LOG_RECORD_INTERVAL) n->interval=n->value;
+                    n->isCarried=TRUE;
+                    return TRUE;
+                }
 
-    // Start by reading the name of the variable
-    while ((bitsToRead--) && (n->state==LOG_OK)
-            && (activeLog==n->currentLog)) n->variable=(n->variable<<1)|_unpump(n);
+            // A run of repeated temperatures is handed out one at a time
+            if (n->repeatsLeft)
+                {
+                    n->repeatsLeft--;
+                    n->variable=LOG_TEMPERATURE;
+                    n->value=n->lastTemp;
+                    n->time+=n->interval;
+                    n->isCarried=FALSE;
+                    n->carry=FALSE;
+                    return TRUE;
+                }
 
-    if (n->state!=LOG_OK) return FALSE;
+            // A block goes before anything in the word after it
+            if (n->blockPending)
+                {
+                    n->blockPending=FALSE;
+                    n->variable=n->blockHeader>>LOG_BLOCK_VAR_SHIFT;
+                    n->value=(n->blockHeader>>LOG_BLOCK_VALUE_SHIFT)&LOG_BLOCK_VALUE_MASK;
+                    n->isCarried=FALSE;
+                    n->carry=FALSE;
+                    return TRUE;
+                }
 
-    // This is a whole new session in the log - recursively grab the next one
-    if (activeLog!=n->currentLog)
-        return logIteratorNext(n);
+            // ...as does a power failure
+            if (n->powerFail)
+                {
+                    n->powerFail=FALSE;
+                    n->variable=LOG_BOD_TRIGGERED;
+                    n->value=TRUE;
+                    n->isCarried=FALSE;
+                    n->carry=FALSE;
+                    return TRUE;
+                }
 
-    // Now the value
-    bitsToRead=vardesc[n->variable].length;
-    while ((bitsToRead--) && (n->state==LOG_OK)
-            && (activeLog==n->currentLog)) n->value=(n->value<<1)|_unpump(n);
+            // Move to the next word when this one has nothing more in it
+            if ((!_take(n, LOG_ELEMENT_BITS, &n->variable)) || (n->variable==LOG_PAD))
+                {
+                    _fill(n);
+                    continue;
+                }
 
-    if (activeLog!=n->currentLog)
-        return logIteratorNext(n);
+            // Now the value
+            if (n->variable==LOG_TEMPERATURE_DELTA)
+                goodRecord=_takeDelta(n, &n->value);
+            else
+                goodRecord=_take(n, n->width[n->variable], &n->value);
 
-    return (n->state==LOG_OK);
+            if (!goodRecord)
+                {
+                    // The word is damaged, so drop the rest of it
+                    n->badWords++;
+                    n->haveTemp=FALSE;
+                    _fill(n);
+                    continue;
+                }
+
+            // A run of repeats goes out from the top of the loop, if the temperature's known
+            if (n->variable==LOG_TEMPERATURE_REPEAT)
+                {
+                    if (n->haveTemp) n->repeatsLeft=n->value;
+                    continue;
+                }
+
+            // Changes in temperature are handed out as the temperature itself, once it's known
+            if (n->variable==LOG_TEMPERATURE_DELTA)
+                {
+                    if (!n->haveTemp) continue;
+                    n->variable=LOG_TEMPERATURE;
+                    n->value+=n->lastTemp;
+                }
+            if (n->variable==LOG_TEMPERATURE)
+                {
+                    n->lastTemp=n->value;
+                    n->haveTemp=TRUE;
+                    n->time+=n->interval;
+                }
+            else if (n->variable==LOG_RECORD_INTERVAL)
+                n->interval=n->value;
+            n->isCarried=FALSE;
+            n->carry=FALSE;
+            return TRUE;
+        }
+    return FALSE;
 }
 // ============================================================================================
 uint32_t logVariable(logIterator *n)
@@ -178,7 +912,15 @@ const char *logVariableName(logIterator *n)
 // Get the prettyprintable name of the next logged element from the iterator
 
 {
-    return vardesc[n->variable].name;
+    return (n->variable<NUM_VARIABLES)?vardesc[n->variable].name:"Unknown";
+}
+// ============================================================================================
+const char *logNameOf(uint32_t variable)
+
+// Get the prettyprintable name of a variable, or NULL if there's no such variable
+
+{
+    return (variable<NUM_VARIABLES)?vardesc[variable].name:NULL;
 }
 // ============================================================================================
 uint32_t logValue(logIterator *n)
@@ -186,7 +928,7 @@ uint32_t logValue(logIterator *n)
 // Get the value from the iterator
 
 {
-    return n->value*vardesc[n->variable].scale;
+    return n->value*n->scale[n->variable];
 }
 // ============================================================================================
 const char *logUnits(logIterator *n)
@@ -194,7 +936,7 @@ const char *logUnits(logIterator *n)
 // Get the string representing the units for the variable
 
 {
-    return vardesc[n->variable].units;
+    return (n->unit[n->variable]<NUM_UNITS)?units[n->unit[n->variable]]:"";
 }
 // ============================================================================================
 uint32_t logScale(logIterator *n)
@@ -202,7 +944,7 @@ uint32_t logScale(logIterator *n)
 // Get the integer representing the scale for the reading (i.e. number of bits after decimal point)
 
 {
-    return vardesc[n->variable].scale;
+    return n->scale[n->variable];
 }
 // ============================================================================================
 logStateType logIteratorState(logIterator *n)
@@ -218,28 +960,133 @@ BOOL logGotoEnd(logIterator *n)
 // Cycle though the log entries until we get to empty space
 
 {
-    // We can fast forward over the other entries without unpumping them as
-    // we know that a new session is always on a four byte boundary
+    // We can fast forward over the other entries without unpacking them as
+    // we know that a new session is always on a four byte boundary. Blocks and power failures are
+    // passed over too.
     while (n->state==LOG_OK)
-        _getNext(n);
+        {
+            n->blockPending=FALSE;
+            n->powerFail=FALSE;
+            _fill(n);
+        }
 
     return (n->state!=LOG_OK);
 }
 // ============================================================================================
 BOOL logGotoLog(logIterator *n, uint32_t logNum)
 
-// Goto a specific log number - assumption is made that we are starting at the beginning
-// or, at least, a log lower than the one we are trying to reach.
+// Goto a specific log number. Recent logs are found directly, otherwise the assumption is made
+// that we are starting at the beginning or, at least, a log lower than the one we are trying to reach.
 
 {
-    // We can fast forward over the other entries without unpumping them as
-    // we know that a new session is always on a four byte boundry
+    nvIterator start;
+
+    if ((!indexBuilt) && (!_indexFind(logNum, &start))) _buildIndex();
+    if (_indexFind(logNum, &start))
+        {
+            n->nv=start;
+            n->state=LOG_OK;
+            n->blockPending=FALSE;
+            n->powerFail=FALSE;
+            _fill(n);
+            return (n->state==LOG_OK);
+        }
+
+    // We can fast forward over the other entries without unpacking them as
+    // we know that a new session is always on a four byte boundry. Blocks and power failures are
+    // passed over too.
     while ((n->state==LOG_OK) && (n->currentLog<logNum))
-        _getNext(n);
+        {
+            n->blockPending=FALSE;
+            n->powerFail=FALSE;
+            _fill(n);
+        }
 
     return (n->state==LOG_OK);
 }
 // ============================================================================================
+BOOL logGotoTime(logIterator *n, uint32_t when)
+
+// Skip on to the last checkpoint at or before when seconds into the current log, if there's one
+// ahead, so the records from there can be read without unpacking all those before. Returns
+// TRUE if the iterator was moved.
+
+{
+    nvIterator v=n->nv, c;
+    nvIterator at;              // Where the words of the checkpoint to go to are
+    uint32_t w[LOG_CHECKPOINT_WORDS];
+    uint32_t readVal;
+    BOOL retVal=FALSE;
+
+    if (n->state!=LOG_OK) return FALSE;
+
+    while (((readVal=nvIteratorNext(&v))!=NV_EMPTY) && (readVal!=LOG_SESSION_START))
+        {
+            if (readVal==LOG_SESSION_SUMMARY)
+                _readSummary(&v, NULL);
+            else if (readVal==LOG_CHECKPOINT)
+                {
+                    c=v;
+                    if (!_readWords(&v, w, LOG_CHECKPOINT_WORDS)) continue;
+                    if (w[0]*n->scale[LOG_RECORD_INTERVAL]>when*mS) break;
+                    at=c;
+                    retVal=TRUE;
+                }
+        }
+    if (!retVal) return FALSE;
+
+    // Only the checkpoint settled on is taken up
+    n->nv=at;
+    n->carry=TRUE;
+    _readCheckpoint(n);
+    n->windowLen=0;
+    n->blockPending=FALSE;
+    n->powerFail=FALSE;
+    n->repeatsLeft=0;
+    return TRUE;
+}
+// ============================================================================================
+uint32_t logTime(logIterator *n)
+
+// Return the seconds into the log of the last temperature read
+
+{
+    return logTimeMs(n)/mS;
+}
+// ============================================================================================
+uint32_t logTimeMs(logIterator *n)
+
+// Return the mS into the log of the last temperature read
+
+{
+    return n->time*n->scale[LOG_RECORD_INTERVAL];
+}
+// ============================================================================================
+uint32_t logBlock(logIterator *n, uint32_t offset, uint32_t *words, uint32_t count)
+
+// Read count words from offset into the block record just read, returning how many there were
+
+{
+    nvIterator b=n->block;
+    uint32_t len=n->blockHeader&LOG_BLOCK_LEN_MASK;
+    uint32_t i=0;
+
+    while ((i<offset+count) && (i<len))
+        {
+            words[(i>=offset)?i-offset:0]=nvIteratorNext(&b);
+            i++;
+        }
+    return (i>offset)?i-offset:0;
+}
+// ============================================================================================
+BOOL logIsCarried(logIterator *n)
+
+// Return TRUE if the record was repeated from before by a checkpoint rather than logged there
+
+{
+    return n->isCarried;
+}
+// ============================================================================================
 uint32_t logCurrentLog(logIterator *n)
 
 // Return number of current log
@@ -248,15 +1095,77 @@ uint32_t logCurrentLog(logIterator *n)
     return n->currentLog;
 }
 // ============================================================================================
+uint32_t logBadWords(logIterator *n)
+
+// Return number of damaged words the iterator has skipped over
+
+{
+    return n->badWords;
+}
+// ============================================================================================
+BOOL logNextSummary(logIterator *n, logSummaryType *s)
+
+// Get the summary of the next log with records in it, moving the iterator on past that log. The
+// temperatures come back scaled like any other reading.
+
+{
+    uint32_t intervalScale, tempScale;
+
+    while (n->state==LOG_OK)
+        {
+            // It's scaled as the schema of the log says, which n has read by now
+            intervalScale=n->scale[LOG_RECORD_INTERVAL];
+            tempScale=n->scale[LOG_TEMPERATURE];
+
+            // The log being written has its summary so far in RAM
+            if (n->currentLog==numLogs)
+                {
+                    *s=current;
+                    logGotoEnd(n);
+                }
+            else
+                _summarise(n, s);
+
+            if (!s->entries) continue;
+
+            // The duration is kept in the units of the record interval
+            s->duration=((uint64_t)s->duration*intervalScale)/mS;
+            if (s->minTemp>s->maxTemp)
+                s->minTemp=s->maxTemp=TEMP_INVALID;
+            else
+                {
+                    s->minTemp*=tempScale;
+                    s->maxTemp*=tempScale;
+                }
+            return TRUE;
+        }
+    return FALSE;
+}
+// ============================================================================================
 BOOL logNewLog(void)
 
 // Create a new log at the end of the storage
 
 {
-    bitStreamLen=0;
-    bitOneCount=0;
+    BOOL goodWrite=_flushRepeats() && _commitWord();  // Finish off the last log
+
+    goodWrite&=_writeSummary();
+    deltasLeft=0;
+    wordsSinceCheckpoint=0;
     numLogs++;
-    return nvWrite_entry(LOG_SESSION_START);
+    _summaryStart(&current, numLogs);
+    nextCheckpoint=LOG_CHECKPOINT_INTERVAL;
+
+    // The session marker goes at the end of what's been written so far
+    nvInitIteratorEnd(&logStart);
+    _indexAdd(numLogs, &logStart);
+    goodWrite&=nvWrite_entry(LOG_SESSION_START) && nvWrite_entry(numLogs) && _writeSchema();
+
+    // The new log starts with the settings carried over from the last one
+    if (haveCarried) goodWrite&=_writeCheckpoint();
+
+    // Make sure the session marker (and everything before it) reaches flash
+    return nvSync() && goodWrite;
 }
 // ============================================================================================
 BOOL logWrite(uint32_t variable, uint32_t value)
@@ -264,24 +1173,115 @@ BOOL logWrite(uint32_t variable, uint32_t value)
 // Write a logged variable to the store...commit to underlying storage as necessary.
 
 {
-    uint32_t bitsToWrite=LOG_ELEMENT_BITS;
-    BOOL goodWrite=TRUE;
     uint32_t varBitsToWrite=vardesc[variable].length;
+    uint32_t i=0;
+    BOOL goodWrite=TRUE;
+    BOOL full;
 
     // Max out the ranges
     value/=vardesc[variable].scale;
     if (value>(1<<varBitsToWrite)-1) value=(1<<varBitsToWrite)-1;
 
-    ASSERT(variable<LOG_ELEMENT_BITS_MASK);
+    ASSERT(variable<NUM_VARIABLES);
+    ASSERT((variable!=LOG_TEMPERATURE_DELTA) && (variable!=LOG_TEMPERATURE_REPEAT));
+    ASSERT(LOG_ELEMENT_BITS+varBitsToWrite<=LOG_PAYLOAD_BITS);
+
+    if (!_due(variable)) return TRUE;
+
+    // Now and again in a long log mark the time, just before a reading, if enough's gone in
+    // since the last time that it's worth it
+    if ((variable==LOG_TEMPERATURE) && (current.duration>=nextCheckpoint)
+            && (wordsSinceCheckpoint>=LOG_CHECKPOINT_MIN_WORDS))
+        goodWrite=_writeCheckpoint();
+
+    _account(&current, &recordInterval, variable, value);
+    while (i<LOG_CHECKPOINT_STATE_LEN)
+        {
+            if (carriedVars[i]==variable)
+                {
+                    carriedValue[i]=value;
+                    haveCarried=TRUE;
+                }
+            i++;
+        }
+
+    // A reading the same as the last is held back to go in a run of them...
+    if ((variable==LOG_TEMPERATURE) && (deltasLeft) && (value==lastTemp))
+        {
+            denter_critical();
+            full=(++repeats==(1u<<vardesc[LOG_TEMPERATURE_REPEAT].length)-1);
+            dleave_critical();
+            if (full) goodWrite&=_flushRepeats();
+            return goodWrite;
+        }
+
+    // ...that ends with anything else
+    goodWrite&=_flushRepeats();
+
+    // Temperatures go as the change from the last one when that's possible
+    if (variable==LOG_TEMPERATURE)
+        {
+            uint32_t temp=value;
+
+            if ((deltasLeft) && (_packDelta(temp, &value, &varBitsToWrite)))
+                {
+                    deltasLeft--;
+                    variable=LOG_TEMPERATURE_DELTA;
+                }
+            else
+                deltasLeft=LOG_KEYFRAME_INTERVAL-1;
+            lastTemp=temp;
+        }
+
+    // The name of the variable, followed by the value
+    return _pack((variable<<varBitsToWrite)|value, LOG_ELEMENT_BITS+varBitsToWrite) && goodWrite;
+}
+// ============================================================================================
+BOOL logWriteBlock(uint32_t variable, uint32_t value, const uint32_t *words, uint32_t count)
+
+// Write a block of words, each with the top bit clear, as one record. They go in a word of their
+// own rather than being packed, so count is limited only by LOG_BLOCK_LEN_MASK.
+
+{
+    ASSERT((variable<NUM_VARIABLES) && (!vardesc[variable].length) && (variable!=LOG_SCHEMA));
+    ASSERT((value<=LOG_BLOCK_VALUE_MASK) && (count<=LOG_BLOCK_LEN_MASK));
+
+    if (!_due(variable)) return TRUE;
+
+    _account(&current, &recordInterval, variable, value);
+    return _writeBlock(variable, value, words, count);
+}
+// ============================================================================================
+BOOL logSync(void)
+
+// Nothing's gone to the store for a while, so put in the run of repeats held back and the word
+// being built too, or a reset without a brownout would lose them. Called when the store's idle
+// timeout goes off, which isn't restarted unless something was written.
 
-    // Start by writing the name of the variable
-    while (bitsToWrite--)
-        goodWrite&=_pump(variable&(1<<bitsToWrite));
+{
+    return _flushRepeats() && _commitWord();
+}
+// ============================================================================================
+BOOL logPowerFail(uint32_t variable, uint32_t value, const uint32_t *words, uint32_t count)
 
-    // Now the value
-    while (varBitsToWrite--)
-        goodWrite&=_pump(value&(1<<varBitsToWrite));
+// The power's going, so get everything held back into the store while there's still the energy
+// to do it, padding out the word being built, and mark the place. A block of count words kept
+// for the occasion follows, as logWriteBlock would write it. Called from the brownout interrupt
+// before writes are stopped. Nothing is done to make room in the store, as that could mean an
+// erase, so the words just go in behind whatever's waiting.
 
+{
+    BOOL goodWrite;
+
+    powerFailing=TRUE;
+    goodWrite=_flushRepeats() && _commitWord();
+    if (_due(LOG_BOD_TRIGGERED))
+        {
+            _account(&current, &recordInterval, LOG_BOD_TRIGGERED, TRUE);
+            goodWrite&=nvAppend(LOG_POWER_FAIL);
+        }
+    if (count) goodWrite&=logWriteBlock(variable, value, words, count);
+    powerFailing=FALSE;
     return goodWrite;
 }
 // ============================================================================================
@@ -293,6 +1293,66 @@ uint32_t logNumLogs(void)
     return numLogs;
 }
 // ============================================================================================
+uint32_t logThinning(void)
+
+// Return how many times the rate of readings should be halved for the log being written to
+// fit in the store. It goes up by one each time the space left to it halves, once that's less
+// than half of the store.
+
+{
+    uint32_t total=nvTotalSpace();
+    uint32_t left=nvSpaceAfter(&logStart);
+    uint32_t level=0;
+
+    while ((level<LOG_MAX_THINNING) && (left<(total>>(level+1))))
+        level++;
+    return level;
+}
+// ============================================================================================
+BOOL logCanSelect(uint32_t variable, uint32_t every)
+
+// Return TRUE if the variable can be logged one in every so many, or left out if that's 0. The
+// time into a log is counted from the temperatures and record intervals, so only the record
+// interval can thin temperatures, and those two and the ones used internally are always logged.
+
+{
+    if ((variable>=NUM_VARIABLES) || (every>LOG_SCHEMA_EVERY_MASK)) return FALSE;
+
+    if ((variable==LOG_RECORD_INTERVAL) || (variable==LOG_TEMPERATURE_DELTA) || (variable==LOG_SCHEMA)
+            || (variable==LOG_TEMPERATURE_REPEAT))
+        return (every==1);
+
+    return ((variable!=LOG_TEMPERATURE) || (every<=1));
+}
+// ============================================================================================
+void logSelect(const uint8_t *every)
+
+// Choose which variables are logged and one in every how many of each, for every variable
+// number. It applies from the next log, or straight away if nothing's gone in this one yet.
+
+{
+    uint32_t i=0;
+    BOOL changed=FALSE;
+
+    while (i<NUM_VARIABLES)
+        {
+            selected[i]=logCanSelect(i, every[i])?every[i]:1;
+            changed|=(selected[i]!=logEvery[i]);
+            i++;
+        }
+
+    if ((changed) && (!current.entries) && (numLogs))
+        _writeSchema();
+}
+// ============================================================================================
+void logSetProfile(uint32_t profile)
+
+// Note the profile being run in the current log, for its summary
+
+{
+    current.profile=profile;
+}
+// ============================================================================================
 BOOL logFlushLogs(void)
 
 // Flush all logs from the store and create a new one
@@ -300,6 +1360,12 @@ BOOL logFlushLogs(void)
 {
     nvFlush();
     numLogs=0;
+    bitStream=0;
+    bitStreamLen=0;
+    repeats=0;
+    current.entries=0;
+    _indexClear();
+    indexBuilt=TRUE;
     return logNewLog();
 }
 // ============================================================================================
@@ -309,13 +1375,26 @@ BOOL logInit(void)
 
 {
     logIterator n;
+    uint32_t i=0;
+
     nvInit();
-    numLogs=0;
+    while (i<LOG_CHECKPOINT_STATE_LEN)
+        carriedValue[i++]=LOG_NO_VALUE;
+    haveCarried=FALSE;
+
+    // Pick up the session numbering from the last session in the store
+    _indexClear();
+    indexBuilt=FALSE;
+    numLogs=_lastSession();
+    bitStream=0;
+    bitStreamLen=0;
+    repeats=0;
 
-    // Spin through memory counting number of valid logs that are there
+    // If that wasn't closed before the power went it needs a summary, which goes in as it is now
+    _summaryStart(&current, numLogs);
     logInitIterator(&n);
-    logGotoEnd(&n);
-    numLogs=logCurrentLog(&n);
+    if ((numLogs) && (logGotoLog(&n, numLogs)) && (n.currentLog==numLogs) && (_summarise(&n, &current)))
+        current.entries=0;
 
     return logNewLog();
 }
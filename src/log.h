@@ -18,15 +18,44 @@ typedef enum {LOG_OK, LOG_ERROR, LOG_ENDSTATE} logStateType;
 typedef struct
 {
     uint32_t currentLog;    // What log number are we on?
-    uint32_t readVal;       // Current read value from memory
-    uint32_t bitsAvail;     // Number of bits available in this read word
-    uint32_t bitOneCount;   // Number of 1's in a row (for bit stuffing removal)
+    uint32_t window;        // Bits of the current word not yet used, next one in bit 0
+    uint32_t windowLen;     // Number of bits in the window
+    uint32_t badWords;      // Words found damaged and skipped
     uint32_t variable;      // The variable last read
     uint32_t value;         // The value for the variable last read
+    uint32_t lastTemp;      // The last temperature read, for changes to be added to...
+    BOOL haveTemp;          // ...if there's been one since the start or any damage
+    uint32_t repeatsLeft;   // Readings of it still to hand out from a run of repeats
+    uint32_t time;          // Time into the log at the last temperature read...
+    uint32_t interval;      // ...and between them, both in the units of the record interval
+    uint32_t carried[LOG_CHECKPOINT_STATE_LEN]; // Values repeated by the last checkpoint...
+    uint32_t carriedNext;   // ...and the next of them to hand out
+    BOOL carry;             // Hand out those values at the next checkpoint
+    BOOL isCarried;         // Record came from a checkpoint rather than being logged there
+    nvIterator block;       // Where the words of the last block record are...
+    uint32_t blockHeader;   // ...what it is and how long
+    BOOL blockPending;      // A block's been read, but not yet handed out
+    BOOL powerFail;         // ...or a power failure
+    uint8_t width[LOG_MAX_VARIABLES];   // Bits in each variable, from the schema of the log...
+    uint8_t unit[LOG_MAX_VARIABLES];    // ...what it's measured in...
+    uint16_t scale[LOG_MAX_VARIABLES];  // ...and what it's multiplied by to get those
     nvIterator nv;          // The underlying iterator over the NV memory
     logStateType state;     // Current state
 } logIterator;
 
+// ----- Summary of a log, written as it's closed
+#define LOG_NO_PROFILE 0x7F
+
+typedef struct
+{
+    uint32_t logNum;        // Which log this is
+    uint32_t entries;       // Number of records in it
+    uint32_t duration;      // Seconds covered by its temperature readings
+    uint32_t minTemp;       // Lowest temperature...
+    uint32_t maxTemp;       // ...and the peak, both TEMP_INVALID if there were none
+    uint32_t profile;       // Profile that was run, or LOG_NO_PROFILE
+} logSummaryType;
+
 // ============================================================================================
 // Iterator over a log - define one of these to access
 // ---------------------------------------------------
@@ -36,13 +65,22 @@ logStateType logIteratorState(logIterator
                               *n);              // Return current state of the log iterator
 uint32_t logIteratorNext(logIterator *n);                   // Get the next element from the log
 BOOL logGotoLog(logIterator *n, uint32_t logNum);           // Goto a specific log number
+BOOL logGotoTime(logIterator *n, uint32_t when);            // Skip to the last checkpoint before a time in this log
+uint32_t logTime(logIterator *n);                           // Return seconds into the log of the last reading
+uint32_t logTimeMs(logIterator *n);                         // ...and the same in mS
+BOOL logIsCarried(logIterator *n);                          // Was the record repeated at a checkpoint?
+uint32_t logBlock(logIterator *n, uint32_t offset,
+                  uint32_t *words, uint32_t count);         // Read part of the block record just read
 uint32_t logCurrentLog(logIterator *n);                     // Return number of current log
+uint32_t logBadWords(logIterator *n);                       // Return number of damaged words skipped
+BOOL logNextSummary(logIterator *n, logSummaryType *s);     // Get the summary of the next log with records
 BOOL logGotoEnd(logIterator
                 *n);                            // Cycle though the log entries until we get to empty space
 
 // Accessors for current value from log
 uint32_t logVariable(logIterator
                      *n);                       // Get the next logged element from the iterator
+const char *logNameOf(uint32_t variable);                   // Get the name of a variable, NULL past the last one
 const char *logVariableName(logIterator
                             *n);                // Get the prettyprintable name of the next logged element from the iterator
 uint32_t logValue(logIterator *n);                          // Get the value from the iterator
@@ -58,11 +96,20 @@ BOOL logNewLog(
 BOOL logFlushLogs(
     void);                                    // Flush all logs from the store and create a new one
 uint32_t logNumLogs(void);                                  // Return number of logs in the store
+void logSetProfile(uint32_t profile);                       // Note the profile being run in the current log
+uint32_t logThinning(void);                                 // How many times to halve the rate of readings to fit
+BOOL logCanSelect(uint32_t variable, uint32_t every);       // Can a variable be logged one in every so many?
+void logSelect(const uint8_t *every);                       // Choose which variables are logged, and how often
 
 // Data entry
 // ----------
 BOOL logWrite(uint32_t variable,
               uint32_t value);           // Write a logged variable to the store...commit to underlying storage as necessary.
+BOOL logWriteBlock(uint32_t variable, uint32_t value,
+                   const uint32_t *words, uint32_t count);  // Write a block of words as a single record
+BOOL logPowerFail(uint32_t variable, uint32_t value,
+                  const uint32_t *words, uint32_t count);   // Get everything into the store as the power goes
+BOOL logSync(void);                                         // Get what's held back in RAM into the store
 
 // ...and the init function - must be called _before_ any other routines
 // ---------------------------------------------------------------------
@@ -15,6 +15,7 @@
 #include "profile.h"
 #include "sensor.h"
 #include "ledflash.h"
+#include "recorder.h"
 #ifdef DEBUG
 #include <cr_mtb_buffer.h>
 __CR_MTB_BUFFER(1024);
@@ -26,17 +27,18 @@ ConfigStoreType sysConfig;
 const ConfigStoreType defaultSysConfig =
 { LEATER_CONFIG }; // This is the default config, in case we need it
 
+const ProfileType defaultProfiles[MAX_PROFILES] =
+{ LEATER_PROFILES }; // ...and the profiles that go with it
+
 // ============================================================================================
 BOOL _getConfig(void)
 
 // Read config and check version numbers, updating if necessary
 
 {
-    nvReadConfig(&sysConfig);
-
-    if (sysConfig.version != LEATER_VERSION_NUMBER)
+    if ((!nvReadConfig(&sysConfig)) || (sysConfig.version != LEATER_VERSION_NUMBER))
         {
-            nvWriteConfig(&defaultSysConfig);
+            nvWriteConfig(&defaultSysConfig, defaultProfiles);
             nvReadConfig(&sysConfig);
             return TRUE;
         }
@@ -95,7 +97,9 @@ int main(void)
     ledInit();
     bodInit();
     logInit();
+    recorderInit();
     newConfig=_getConfig();
+    logSelect(sysConfig.logEvery);
     flagInit();
     gpioInit();
     gpioHeat(OFF);
@@ -111,7 +115,11 @@ int main(void)
     while (1)
         {
             flagSet = flag_get();
-            if (!flagSet) __WFI();
+            if (!flagSet)
+                {
+                    // Nothing else waiting, so get on with any flash work before sleeping
+                    if (!nvRunJob()) __WFI();
+                }
             else
                 {
 #ifdef SENSOR_THERMISTOR
@@ -2,18 +2,95 @@
  * Manage non-volatile storage.  This is the 'spare' flash from the top of program to the end
  * of the flash space.  The current configuration is stored right at the very top and the rest
  * of the spare memory is given over to log storage.
+ *
+ * The log storage is a ring. Before the writer moves into a new sector the one after it is
+ * erased, dropping the oldest data, so logging never has to stop. With LOG_STORE_FRAM defined
+ * the log goes to an external device instead (nvfram.c) and only the config is kept here.
  */
 
+#include <stddef.h>
 #include "config.h"
 #include "dutils.h"
 #include "nv.h"
 #include "printf.h"
 #include "bod.h"
+#include "timers.h"
+#include "log.h"
 
 #define NV_END           0x00004000                         // End of NV store
 
 #define NV_BLOCK_LEN     64
 #define NV_SECTOR_LEN    1024
+#define NV_BLOCK_WORDS   (NV_BLOCK_LEN/sizeof(uint32_t))
+#define NV_BLOCK_MASK    (~(NV_BLOCK_LEN-1))
+#define NV_SECTOR_MASK   (~(NV_SECTOR_LEN-1))
+#define NV_MAX_UNITS     (NV_END/NV_SECTOR_LEN)
+
+// Each block of log starts with a header holding a sequence number, so the newest and oldest
+// data can be found once the store has wrapped, and the erase count of the unit it lives in.
+#define NV_SEQ_LIMIT     0xFFFF                             // Sequence numbers run 0..0xFFFE
+#define NV_WEAR_MAX      0xFFFF
+#define NV_HDR(wear,seq) (((wear)<<16)|(seq))
+#define NV_HDR_SEQ(x)    ((x)&0xFFFF)
+#define NV_HDR_WEAR(x)   ((x)>>16)
+
+// A cursor holds the sequence number of a block over the word offset of a place in it, so it can
+// be told if the block's been reused since
+#define NV_CURSOR(seq,addr) (((seq)<<16)|(((addr)-first_free_page)>>2))
+#define NV_CURSOR_SEQ(x)    ((x)>>16)
+#define NV_CURSOR_ADDR(x)   (first_free_page+(((x)&0xFFFF)<<2))
+
+// Time with no new entries after which a part-filled write block is committed to flash anyway
+#ifndef NV_IDLE_FLUSH_TIME
+#define NV_IDLE_FLUSH_TIME (120*mS)
+#endif
+
+// Time after a config commit before the superseded slot is erased, ready for the next one
+#define NV_CONFIG_ERASE_TIME (2*mS)
+
+// Flash work is queued and done from the main loop when nothing else is waiting
+#define NV_QUEUE_LEN     8                                  // Jobs that can be waiting
+#define NV_QUEUE_BLOCKS  3                                  // Log blocks that can be waiting
+#define NV_QBLOCK_BUSY   0xFFFFFFFE                         // Address of a waiting block being programmed
+
+// Timer numbers, for telling the timeouts apart
+#define NV_TIMER_IDLE    0
+#define NV_TIMER_CONFIG  1
+
+// The config is kept in two alternating slots at the top of flash. Each holds a generation
+// number and a CRC, so a commit goes into the slot not in use and the newest good one wins.
+typedef struct
+{
+    ConfigStoreType c;
+    ProfileType profile[MAX_PROFILES];  // Profiles are only ever read from here, never copied
+    uint32_t generation;
+    uint32_t crc;                       // Over the config, profiles and generation
+} _ConfigSlotType;
+
+// Slots are written a block at a time, but keep to the sizes an IAP write allows
+#define NV_CONFIG_SLOT_LEN ((sizeof(_ConfigSlotType)<=64)?64:(sizeof(_ConfigSlotType)<=128)?128: \
+                            (sizeof(_ConfigSlotType)<=256)?256:(sizeof(_ConfigSlotType)<=512)?512:1024)
+#define NV_CONFIG_SLOTS    2
+#define NV_NO_SLOT         NV_EMPTY
+
+// A piece of flash work waiting to be done
+typedef struct
+{
+    nvJobType type;
+    uint32_t start;                     // Flash address the job works on
+    uint32_t end;                       // End of range for erases, queue block for programs
+    uint32_t unit;                      // Log unit being erased, or NV_EMPTY
+} _nvJobType;
+
+#ifdef HOST_BUILD
+// Off target the flash is an image file mapped in by the IAP emulator, and all access to it goes
+// through NV_FLASH to turn flash addresses into somewhere we can read
+#include "iaphost.h"
+#define NV_FLASH(addr)   ((uint32_t *)(iapHostFlash+(uint32_t)(addr)))
+#define iap_entry        iapHostEntry
+#else
+#define NV_FLASH(addr)   ((uint32_t *)(addr))
+#endif
 
 extern uint32_t _edata;                 // Symbol from linker representing end of initialised data
 extern uint32_t _data;                  // Symbol from linker representing start of initialised data
@@ -26,17 +103,54 @@ extern uint32_t _etext;                 // Symbol from linker representing end o
 #endif
 
 #define IAP_LOCATION 0x1FFF1FF1
+#define IAP_SECTOR_ERASE 52
+#define IAP_PAGE_ERASE   59
+#ifndef HOST_BUILD
 typedef void (*IAP)(unsigned long[], unsigned long[]);
 const IAP iap_entry=(IAP)IAP_LOCATION;
+#endif
 
-static uint32_t *nv_wp=0;               // Current position in NV store for writing
 uint32_t first_free_page;               // First free location
 uint32_t config_store_page;             // Last free location before config
+
+#ifndef LOG_STORE_FRAM
+static uint32_t *nv_wp=0;               // Current position in NV store for writing
+static uint32_t nv_tail;                // Start of the oldest data in the store
+static uint32_t nv_seq;                 // Sequence number for the next block
+static uint32_t nv_units;               // Number of erase units in the log area
+static uint16_t nv_wear[NV_MAX_UNITS];  // Erase count for each unit
+
+// Write-back copy of the block containing nv_wp. Entries collect here and the block is
+// programmed once when it fills, or earlier when nvSync is called.
+static uint32_t nv_block[NV_BLOCK_WORDS];
+static BOOL nv_dirty;                   // Block holds entries not yet in flash
+static BOOL nv_ahead;                   // Writer has entered a new unit, the one after needs erasing
+#endif
+static timerType nv_t;                  // Idle timer for committing a part-filled block
+static timerType nv_cfg_t;              // Timer for erasing a superseded config slot
+nvStatsType nv_stats;                   // Counters for store activity, shared with nvfram.c
+
+// The flash job queue. Readers see the store as it will be once the queue is worked through,
+// so blocks waiting to be programmed are kept here and units waiting for erase read as empty.
+static _nvJobType nv_q[NV_QUEUE_LEN];
+static uint32_t nv_qrp;                 // Next job to run
+static uint32_t nv_qwp;                 // Where the next job goes
+static uint32_t nv_qblock[NV_QUEUE_BLOCKS][NV_BLOCK_WORDS];
+static uint32_t nv_qblockAddr[NV_QUEUE_BLOCKS]; // Where each waiting block goes, NV_EMPTY if free
+static uint32_t nv_erasePending;        // Bitmask of log units with an erase waiting
+// The config waiting to be committed. There's no room to keep the slot image for it, so that's put
+// together a block at a time as it's written.
+static ConfigStoreType nv_cfg;          // Config to be written...
+static const ProfileType *nv_cfg_profiles; // ...with the profiles to go with it...
+static uint32_t nv_cfg_generation;      // ...and its generation...
+static BOOL nv_cfg_pending;             // ...and if it's still waiting
+static uint32_t nv_cfg_slot;            // Slot holding the newest good config
 // ============================================================================================
-BOOL _write_sector(uint32_t page_start, uint32_t *data_to_store)
+BOOL _write_sector(uint32_t page_start, uint32_t *data_to_store, uint32_t len)
 
 // Write sector to flash using rom based routines. New data is written to first free location
-// and assumption is made that existing data does not change.
+// and assumption is made that existing data does not change. len must be 64, 128, 256, 512
+// or 1024 bytes.
 
 {
     unsigned long command[5], result[4];
@@ -46,7 +160,7 @@ BOOL _write_sector(uint32_t page_start, uint32_t *data_to_store)
     // Prepare sector for write
     command[0]=50;
     command[1]=(uint32_t)page_start/NV_SECTOR_LEN;
-    command[2]=(uint32_t)page_start/NV_SECTOR_LEN;
+    command[2]=((uint32_t)page_start+len-1)/NV_SECTOR_LEN;
     command[3]=SystemCoreClock;
     denter_critical();
     iap_entry(command,result);
@@ -59,27 +173,27 @@ BOOL _write_sector(uint32_t page_start, uint32_t *data_to_store)
     // Perform the write
     command[0]=51;
     command[1]=(uint32_t)page_start&0xFFFFFFC0;
-    command[2]=(uint32_t)data_to_store;
-    command[3]=NV_BLOCK_LEN;
+    command[2]=(unsigned long)data_to_store;
+    command[3]=len;
     command[4]=SystemCoreClock/1000;
     iap_entry(command,result);
     dleave_critical();
+    nv_stats.programs++;
     return result[0]==0;
 }
 // ============================================================================================
-BOOL _flush_sector(uint32_t page_start)
+BOOL _eraseRange(uint32_t eraseCmd, uint32_t start, uint32_t end, uint32_t len)
 
-// Scrub a sector back to 0xFFFFFFFF
+// Scrub from start up to (but not including) end using the IAP erase command given, which
+// works in chunks of len bytes
 
 {
     unsigned long command[5], result[4];
 
-    if (bodIsActive()) return FALSE;
-
-    // Prepare sector for write
+    // Prepare sectors for write
     command[0] = 50;
-    command[1] = page_start / NV_SECTOR_LEN;
-    command[2] = page_start / NV_SECTOR_LEN;
+    command[1] = start / NV_SECTOR_LEN;
+    command[2] = (end - 1) / NV_SECTOR_LEN;
     command[3] = SystemCoreClock / 1000;
 
     denter_critical();
@@ -91,38 +205,606 @@ BOOL _flush_sector(uint32_t page_start)
         }
 
     // Now perform the scrub
-    command[0] = 59;
-    command[1] = page_start / NV_BLOCK_LEN;
-    command[2] = page_start / NV_BLOCK_LEN;
+    command[0] = eraseCmd;
+    command[1] = start / len;
+    command[2] = (end - 1) / len;
+    command[3] = SystemCoreClock / 1000;
     iap_entry(command, result);
     dleave_critical();
+    nv_stats.erases++;
     return (result[0]==0);
 }
 // ============================================================================================
-BOOL _realWrite_entry(uint32_t val_to_write)
+BOOL _flush_pages(uint32_t page_start, uint32_t page_end)
 
-// ACtually write the sector, assuming we're not in a brownout condition
+// Scrub the pages from page_start up to (but not including) page_end back to 0xFFFFFFFF.
+// Whole sectors go in one sector erase, leaving page erases for any ragged edges.
 
 {
-    uint32_t ram_block[16];  // 64 Bytes read from sector
-    uint32_t readPos=0;
-    uint32_t *rp=(uint32_t *)((uint32_t)nv_wp&0xFFFFFFC0);  // Go to start of this sector
+    uint32_t secStart=(page_start+NV_SECTOR_LEN-1)&NV_SECTOR_MASK;
+    uint32_t secEnd=page_end&NV_SECTOR_MASK;
+    BOOL retVal=TRUE;
 
     if (bodIsActive()) return FALSE;
 
-    // If nv isn't available, or full, return false
-    if ((!nv_wp) || ((uint32_t)nv_wp>=(config_store_page-1))) return FALSE;
+    if (secStart>=secEnd)
+        return _eraseRange(IAP_PAGE_ERASE, page_start, page_end, NV_BLOCK_LEN);
 
-    while (readPos<16) ram_block[readPos++]=*rp++; // Read the data that's there
+    if (page_start<secStart)
+        retVal=_eraseRange(IAP_PAGE_ERASE, page_start, secStart, NV_BLOCK_LEN);
+    if (retVal)
+        retVal=_eraseRange(IAP_SECTOR_ERASE, secStart, secEnd, NV_SECTOR_LEN);
+    if ((retVal) && (secEnd<page_end))
+        retVal=_eraseRange(IAP_PAGE_ERASE, secEnd, page_end, NV_BLOCK_LEN);
+    return retVal;
+}
+// ============================================================================================
+uint8_t _slotByte(uint32_t offset, uint32_t crc)
 
-    // Now put the new value in...
-    ram_block[((uint32_t)nv_wp&0x3F)>>2]=val_to_write;
-    if (_write_sector((uint32_t)nv_wp&0xFFFFFFC0, ram_block))
-        nv_wp+=1;  // Need to move on by four bytes, but these are uint32_t, so thats +1
+// Return a byte of the config slot waiting to be written, with crc in its CRC field. Anything
+// not part of a field is left erased.
+
+{
+    const uint8_t *src=NULL;
+
+    if (offset<sizeof(ConfigStoreType))
+        src=(const uint8_t *)&nv_cfg+offset;
+    else if ((nv_cfg_profiles) && (offset>=offsetof(_ConfigSlotType, profile))
+             && (offset<offsetof(_ConfigSlotType, profile)+sizeof(ProfileType)*MAX_PROFILES))
+        src=(const uint8_t *)nv_cfg_profiles+offset-offsetof(_ConfigSlotType, profile);
+    else if ((offset>=offsetof(_ConfigSlotType, generation)) && (offset<offsetof(_ConfigSlotType, generation)+sizeof(uint32_t)))
+        src=(const uint8_t *)&nv_cfg_generation+offset-offsetof(_ConfigSlotType, generation);
+    else if ((offset>=offsetof(_ConfigSlotType, crc)) && (offset<offsetof(_ConfigSlotType, crc)+sizeof(uint32_t)))
+        src=(const uint8_t *)&crc+offset-offsetof(_ConfigSlotType, crc);
+
+    return src?*src:0xFF;
+}
+// ============================================================================================
+BOOL _writeSlot(uint32_t start)
+
+// Program the config waiting into the slot at start. The CRC is worked out first, then the
+// slot is put together and programmed a block at a time, leaving out blocks with nothing in.
+
+{
+    uint32_t block[NV_BLOCK_WORDS];
+    uint32_t crc=0, offset=0, i;
+    uint8_t b;
+    BOOL retVal=TRUE, blank;
+
+    while (offset<offsetof(_ConfigSlotType, crc))
+        {
+            b=_slotByte(offset++, 0);
+            crc=dcrc32(crc, &b, 1);
+        }
+
+    offset=0;
+    while ((retVal) && (offset<NV_CONFIG_SLOT_LEN))
+        {
+            i=0;
+            blank=TRUE;
+            while (i<NV_BLOCK_LEN)
+                {
+                    ((uint8_t *)block)[i]=_slotByte(offset+i, crc);
+                    blank&=(((uint8_t *)block)[i++]==0xFF);
+                }
+            if (!blank) retVal=_write_sector(start+offset, block, NV_BLOCK_LEN);
+            offset+=NV_BLOCK_LEN;
+        }
+    return retVal;
+}
+// ============================================================================================
+void _scheduleSlotErase(void);
+uint32_t _activeSlot(void);
+// ============================================================================================
+BOOL _runJob(void)
+
+// Run the oldest job waiting in the queue, noting how long it held things up for. The job comes
+// off the queue before it's started, so the brownout interrupt can't run it as well, and its
+// block isn't touched until it's done. Interrupts are only off for each IAP call.
+
+{
+    _nvJobType j;
+    uint32_t startTime;
+    BOOL retVal=TRUE;
+
+    if (bodIsActive()) return FALSE;
+
+    denter_critical();
+    if (nv_qrp==nv_qwp)
+        {
+            dleave_critical();
+            return FALSE;
+        }
 
+    j=nv_q[nv_qrp];
+    nv_qrp=(nv_qrp+1)%NV_QUEUE_LEN;
+    if (j.type==NV_JOB_PROGRAM) nv_qblockAddr[j.end]=NV_QBLOCK_BUSY;
+    dleave_critical();
+
+    startTime=timerMicros();
+    switch (j.type)
+        {
+            case NV_JOB_PROGRAM:
+                retVal=_write_sector(j.start, nv_qblock[j.end], NV_BLOCK_LEN);
+                nv_qblockAddr[j.end]=NV_EMPTY;
+                break;
+
+            case NV_JOB_ERASE:
+                retVal=_flush_pages(j.start, j.end);
+                if (j.unit!=NV_EMPTY)
+                    {
+                        denter_critical();
+                        nv_erasePending&=~(1<<j.unit);
+                        dleave_critical();
+                    }
+                break;
+
+            case NV_JOB_CONFIG:
+                retVal=_writeSlot(j.start);
+                nv_cfg_pending=FALSE;
+                break;
+
+            default:
+                // Job was cancelled
+                break;
+        }
+
+    startTime=timerMicros()-startTime;
+    if (startTime>nv_stats.jobMax[j.type]) nv_stats.jobMax[j.type]=startTime;
+    nv_stats.jobs++;
+
+    // A new config needs checking, then the old one can be cleared out ready for next time
+    if ((j.type==NV_JOB_CONFIG) && (retVal))
+        {
+            nv_cfg_slot=_activeSlot();
+            retVal=(nv_cfg_slot==(j.start-config_store_page)/NV_CONFIG_SLOT_LEN);
+            _scheduleSlotErase();
+        }
+
+    if (!retVal) nv_stats.failures++;
     return TRUE;
 }
 // ============================================================================================
+BOOL _postJob(nvJobType type, uint32_t start, uint32_t end, uint32_t unit)
+
+// Add a job to the queue, making room by running the oldest one if it's full
+
+{
+    while ((nv_qwp+1)%NV_QUEUE_LEN==nv_qrp)
+        {
+            nv_stats.forced++;
+            if (!_runJob()) return FALSE;
+        }
+
+    denter_critical();
+    nv_q[nv_qwp].type=type;
+    nv_q[nv_qwp].start=start;
+    nv_q[nv_qwp].end=end;
+    nv_q[nv_qwp].unit=unit;
+    nv_qwp=(nv_qwp+1)%NV_QUEUE_LEN;
+    dleave_critical();
+    return TRUE;
+}
+// ============================================================================================
+void _idleRestart(void)
+
+// (Re)start the idle countdown, after which anything waiting is committed anyway. The log store
+// in nvfram.c uses this too.
+
+{
+    if (timerRunning(&nv_t)) timerDel(&nv_t);
+    timerAdd(&nv_t, TIMER_ORIGIN_NV, NV_TIMER_IDLE, NV_IDLE_FLUSH_TIME);
+}
+// ============================================================================================
+uint32_t _storedWord(uint32_t *rp)
+
+// Return a word as it will be in flash once the queue has been worked through
+
+{
+    uint32_t b=0;
+
+    while (b<NV_QUEUE_BLOCKS)
+        {
+            if (nv_qblockAddr[b]==((uint32_t)rp&NV_BLOCK_MASK))
+                return nv_qblock[b][((uint32_t)rp&(NV_BLOCK_LEN-1))>>2];
+            b++;
+        }
+
+    if (((uint32_t)rp>=first_free_page) && ((uint32_t)rp<config_store_page)
+            && (nv_erasePending&(1<<((uint32_t)rp/NV_SECTOR_LEN-first_free_page/NV_SECTOR_LEN))))
+        return NV_EMPTY;
+
+    return *NV_FLASH(rp);
+}
+#ifndef LOG_STORE_FRAM
+// ============================================================================================
+uint32_t _unitStart(uint32_t unit)
+
+// Return the first address of an erase unit. Units are the parts of each flash sector that
+// lie within the log area, so the first and last may be short.
+
+{
+    uint32_t a=(first_free_page&NV_SECTOR_MASK)+unit*NV_SECTOR_LEN;
+    return (a<first_free_page)?first_free_page:a;
+}
+// ============================================================================================
+uint32_t _unitEnd(uint32_t unit)
+
+// Return the address just after an erase unit
+
+{
+    uint32_t a=(first_free_page&NV_SECTOR_MASK)+(unit+1)*NV_SECTOR_LEN;
+    return (a>config_store_page)?config_store_page:a;
+}
+// ============================================================================================
+uint32_t _unitOf(uint32_t addr)
+
+// Return the erase unit holding an address
+
+{
+    return (addr/NV_SECTOR_LEN)-(first_free_page/NV_SECTOR_LEN);
+}
+// ============================================================================================
+uint32_t _header(uint32_t unit)
+
+// Return the header of the first block in a unit
+
+{
+    return _storedWord((uint32_t *)_unitStart(unit));
+}
+// ============================================================================================
+BOOL _eraseUnit(uint32_t unit)
+
+// Queue the erase of a whole unit, keeping track of how worn it is and moving the tail on if
+// it was there
+
+{
+    uint32_t hdr=_header(unit);
+    uint32_t j;
+
+    if (nv_erasePending&(1<<unit)) return TRUE;
+    if (hdr!=NV_EMPTY) nv_wear[unit]=NV_HDR_WEAR(hdr);
+
+    // Anything still waiting to be programmed there would only be erased again
+    denter_critical();
+    j=nv_qrp;
+    while (j!=nv_qwp)
+        {
+            if ((nv_q[j].type==NV_JOB_PROGRAM) && (_unitOf(nv_q[j].start)==unit))
+                {
+                    nv_qblockAddr[nv_q[j].end]=NV_EMPTY;
+                    nv_q[j].type=NV_JOB_NONE;
+                }
+            j=(j+1)%NV_QUEUE_LEN;
+        }
+    nv_erasePending|=(1<<unit);
+    dleave_critical();
+
+    if (!_postJob(NV_JOB_ERASE, _unitStart(unit), _unitEnd(unit), unit))
+        {
+            nv_erasePending&=~(1<<unit);
+            return FALSE;
+        }
+    if (nv_wear[unit]<NV_WEAR_MAX) nv_wear[unit]++;
+
+    if (_unitOf(nv_tail)==unit)
+        nv_tail=_unitStart((unit+1)%nv_units);
+    return TRUE;
+}
+// ============================================================================================
+BOOL _prepareAhead(void)
+
+// Make sure the unit after the one being written is empty, so there's always a gap between
+// the newest and the oldest data. This is where the oldest data gets dropped.
+
+{
+    uint32_t unit=(_unitOf((uint32_t)nv_wp)+1)%nv_units;
+
+    if (_header(unit)==NV_EMPTY) return TRUE;
+    return _eraseUnit(unit);
+}
+// ============================================================================================
+void _loadBlock(void)
+
+// Fill the write-back block with whatever is already in flash for the block containing nv_wp
+
+{
+    uint32_t readPos=0;
+    uint32_t *rp=(uint32_t *)((uint32_t)nv_wp&NV_BLOCK_MASK);
+
+    while (readPos<NV_BLOCK_WORDS) nv_block[readPos++]=_storedWord(rp++);
+    nv_dirty=FALSE;
+}
+// ============================================================================================
+BOOL _roomToQueue(void)
+
+// Is there room to queue the write-back block without running anything first? There is if an
+// earlier copy is waiting, or there's a free buffer and a free place in the queue.
+
+{
+    uint32_t b=0;
+    uint32_t addr=(uint32_t)nv_wp&NV_BLOCK_MASK;
+
+    while (b<NV_QUEUE_BLOCKS)
+        {
+            if (nv_qblockAddr[b++]==addr) return TRUE;
+        }
+
+    if ((nv_qwp+1)%NV_QUEUE_LEN==nv_qrp) return FALSE;
+
+    b=0;
+    while ((b<NV_QUEUE_BLOCKS) && (nv_qblockAddr[b]!=NV_EMPTY)) b++;
+    return (b<NV_QUEUE_BLOCKS);
+}
+// ============================================================================================
+BOOL _queueBlock(void)
+
+// Queue the write-back block for programming if it holds anything new, as long as there's room
+// for it. If an earlier copy of the block is still waiting then that's just brought up to date.
+
+{
+    uint32_t b=0, i=0;
+    uint32_t addr=(uint32_t)nv_wp&NV_BLOCK_MASK;
+
+    denter_critical();
+    if (!nv_dirty)
+        {
+            dleave_critical();
+            return TRUE;
+        }
+
+    if (!_roomToQueue())
+        {
+            dleave_critical();
+            return FALSE;
+        }
+
+    // Look for an earlier copy, or failing that a free buffer, which there's a place in the
+    // queue for
+    while ((b<NV_QUEUE_BLOCKS) && (nv_qblockAddr[b]!=addr)) b++;
+    if (b==NV_QUEUE_BLOCKS)
+        {
+            b=0;
+            while (nv_qblockAddr[b]!=NV_EMPTY) b++;
+            _postJob(NV_JOB_PROGRAM, addr, b, NV_EMPTY);
+        }
+
+    while (i<NV_BLOCK_WORDS)
+        {
+            nv_qblock[b][i]=nv_block[i];
+            i++;
+        }
+    nv_qblockAddr[b]=addr;
+    nv_dirty=FALSE;
+    dleave_critical();
+    return TRUE;
+}
+// ============================================================================================
+BOOL _syncBlock(void)
+
+// Queue the write-back block for programming, getting the oldest jobs out of the way first if
+// there's no room for it
+
+{
+    while ((nv_dirty) && (!_roomToQueue()))
+        {
+            nv_stats.forced++;
+            if (!_runJob()) return FALSE;
+        }
+    return _queueBlock();
+}
+// ============================================================================================
+BOOL _runPrograms(void)
+
+// Program every waiting block that doesn't have to wait for an erase, leaving the erases in the
+// queue. Programs queued behind the erase of their unit are left too.
+
+{
+    uint32_t j;
+    BOOL retVal=TRUE;
+
+    denter_critical();
+    j=nv_qrp;
+    while (j!=nv_qwp)
+        {
+            if ((nv_q[j].type==NV_JOB_PROGRAM) && (!(nv_erasePending&(1<<_unitOf(nv_q[j].start)))))
+                {
+                    if (!_write_sector(nv_q[j].start, nv_qblock[nv_q[j].end], NV_BLOCK_LEN))
+                        {
+                            nv_stats.failures++;
+                            retVal=FALSE;
+                        }
+                    nv_qblockAddr[nv_q[j].end]=NV_EMPTY;
+                    nv_q[j].type=NV_JOB_NONE;
+                }
+            j=(j+1)%NV_QUEUE_LEN;
+        }
+
+    // Anything done at the front of the queue can come off it
+    while ((nv_qrp!=nv_qwp) && (nv_q[nv_qrp].type==NV_JOB_NONE))
+        nv_qrp=(nv_qrp+1)%NV_QUEUE_LEN;
+    dleave_critical();
+    return retVal;
+}
+// ============================================================================================
+uint32_t _readWord(uint32_t *rp)
+
+// Read a word from the store, taking account of anything still waiting in the write-back block
+
+{
+    if (((uint32_t)rp&NV_BLOCK_MASK)==((uint32_t)nv_wp&NV_BLOCK_MASK))
+        return nv_block[((uint32_t)rp&(NV_BLOCK_LEN-1))>>2];
+    return _storedWord(rp);
+}
+// ============================================================================================
+BOOL _newer(uint32_t hdr, uint32_t than)
+
+// Is the block with this header at least as new as the other one? Sequence numbers wrap, but the
+// store is small enough that the live ones always sit in one half of the number space.
+
+{
+    return (hdr!=NV_EMPTY)
+           && (((NV_HDR_SEQ(hdr)-NV_HDR_SEQ(than)+NV_SEQ_LIMIT)%NV_SEQ_LIMIT)<NV_SEQ_LIMIT/2);
+}
+// ============================================================================================
+BOOL _locateEnd(void)
+
+// Find the newest block in the store and the write position in it, then the oldest block
+
+{
+    uint32_t *rp;
+    uint32_t lo=1, hi=nv_units, mid;
+    uint32_t first=_header(0), hdr;
+    uint32_t unit, u;
+
+    nv_stats.seekReads++;
+
+    // Find the unit that was written last. Going round from unit 0 the units are newer than
+    // unit 0 up to there, and then either empty or older, so a binary search will do it...
+    if (first!=NV_EMPTY)
+        {
+            while (lo<hi)
+                {
+                    mid=(lo+hi)/2;
+                    nv_stats.seekReads++;
+                    if (_newer(_header(mid),first))
+                        lo=mid+1;
+                    else
+                        hi=mid;
+                }
+            unit=lo-1;
+        }
+    else
+        {
+            // ...unless unit 0 is in the gap, in which case it's the last one before it, or we're
+            // empty. The gap is usually one unit, but can be more after an interrupted flush.
+            unit=nv_units-1;
+            while ((unit) && (_header(unit)==NV_EMPTY))
+                {
+                    nv_stats.seekReads++;
+                    unit--;
+                }
+        }
+
+    // Blocks in the unit fill in order, so binary search for the first empty one...
+    lo=0;
+    hi=(_unitEnd(unit)-_unitStart(unit))/NV_BLOCK_LEN;
+    while (lo<hi)
+        {
+            mid=(lo+hi)/2;
+            nv_stats.seekReads++;
+            if (*NV_FLASH(_unitStart(unit)+mid*NV_BLOCK_LEN)==NV_EMPTY)
+                hi=mid;
+            else
+                lo=mid+1;
+        }
+
+    // ...then the write pointer is somewhere in the block before it
+    rp=(uint32_t *)(_unitStart(unit)+(lo?lo-1:0)*NV_BLOCK_LEN);
+    if (*NV_FLASH(rp)!=NV_EMPTY) nv_seq=(NV_HDR_SEQ(*NV_FLASH(rp))+1)%NV_SEQ_LIMIT;
+    while ((rp<(uint32_t *)_unitEnd(unit)) && (*NV_FLASH(rp)!=NV_EMPTY))
+        {
+            nv_stats.seekReads++;
+            rp++;
+        }
+    if ((uint32_t)rp>=config_store_page) rp=(uint32_t *)first_free_page;
+    nv_wp=rp;
+
+    // The oldest data is in the first unit round from here that isn't empty. Pick up the wear
+    // from each unit as we go; an empty one is assumed to be like the one before it.
+    if (_header(unit)!=NV_EMPTY) nv_wear[unit]=NV_HDR_WEAR(_header(unit));
+    nv_tail=_unitStart(unit);
+    for (u=1; u<nv_units; u++)
+        {
+            hdr=_header((unit+u)%nv_units);
+            if (hdr!=NV_EMPTY)
+                {
+                    if (nv_tail==_unitStart(unit)) nv_tail=_unitStart((unit+u)%nv_units);
+                    nv_wear[(unit+u)%nv_units]=NV_HDR_WEAR(hdr);
+                }
+            else
+                nv_wear[(unit+u)%nv_units]=nv_wear[(unit+u-1)%nv_units];
+        }
+
+    _loadBlock();
+    return _prepareAhead();
+}
+// ============================================================================================
+#endif
+// ============================================================================================
+uint32_t _slotStart(uint32_t slot)
+
+// Return the flash address of a config slot
+
+{
+    return config_store_page+slot*NV_CONFIG_SLOT_LEN;
+}
+// ============================================================================================
+const _ConfigSlotType *_configSlot(uint32_t slot)
+
+// Return the contents of a config slot
+
+{
+    return (const _ConfigSlotType *)NV_FLASH(_slotStart(slot));
+}
+// ============================================================================================
+BOOL _slotBlank(uint32_t slot)
+
+// Check if a config slot is fully erased
+
+{
+    uint32_t *rp=(uint32_t *)_slotStart(slot);
+
+    while ((rp<(uint32_t *)(_slotStart(slot)+NV_CONFIG_SLOT_LEN)) && (*NV_FLASH(rp)==NV_EMPTY)) rp++;
+    return (rp==(uint32_t *)(_slotStart(slot)+NV_CONFIG_SLOT_LEN));
+}
+// ============================================================================================
+uint32_t _activeSlot(void)
+
+// Return the slot holding the newest good config, or NV_NO_SLOT if there isn't one
+
+{
+    uint32_t slot=0, active=NV_NO_SLOT;
+
+    while (slot<NV_CONFIG_SLOTS)
+        {
+            if ((_configSlot(slot)->generation!=NV_EMPTY)
+                    && (dcrc32(0, _configSlot(slot), offsetof(_ConfigSlotType, crc))==_configSlot(slot)->crc)
+                    && ((active==NV_NO_SLOT) || (_configSlot(slot)->generation>_configSlot(active)->generation)))
+                active=slot;
+            slot++;
+        }
+    return active;
+}
+// ============================================================================================
+void _scheduleSlotErase(void)
+
+// Arrange for the slots not in use to be erased a little later, off the commit path
+
+{
+    if (timerRunning(&nv_cfg_t)) timerDel(&nv_cfg_t);
+    timerAdd(&nv_cfg_t, TIMER_ORIGIN_NV, NV_TIMER_CONFIG, NV_CONFIG_ERASE_TIME);
+}
+// ============================================================================================
+void _eraseStaleSlots(void)
+
+// Erase any config slot that isn't the one in use
+
+{
+    uint32_t slot=0, active=_activeSlot();
+
+    // With nothing good there's nothing to keep either, but leave it for the next commit. If
+    // a new config is still waiting to go in then this will be rescheduled when it has.
+    if ((active==NV_NO_SLOT) || (nv_cfg_pending)) return;
+
+    while (slot<NV_CONFIG_SLOTS)
+        {
+            if ((slot!=active) && (!_slotBlank(slot)))
+                _postJob(NV_JOB_ERASE, _slotStart(slot), _slotStart(slot)+NV_CONFIG_SLOT_LEN, NV_EMPTY);
+            slot++;
+        }
+}
+// ============================================================================================
 // ============================================================================================
 // ============================================================================================
 // Externally available routines
@@ -151,165 +833,480 @@ uint32_t nvRead_partVersion(void)
     return result[1];
 }
 // ============================================================================================
-BOOL nvWrite_entry(uint32_t val_to_write)
+BOOL nvRunJob(void)
 
-// Write value to store, but check it's not NV_EMPTY (0xFFFFFFFF) first.
+// Run one waiting flash job, returning FALSE if there weren't any. Call when nothing more
+// urgent is waiting.
 
 {
-    // Not allowed to write empty values - assert check
-    ASSERT(val_to_write!=NV_EMPTY);
-    return _realWrite_entry(val_to_write);
+    return _runJob();
 }
 // ============================================================================================
-BOOL nvFlush(void)
+void nvDrain(void)
 
-// Flush the whole of the log memory
+// Run all waiting flash jobs now
 
 {
-    uint32_t flushmem = first_free_page;
+    while (_runJob());
+}
+// ============================================================================================
+void nvTimeout(uint32_t timerNumber)
 
-    do
+// Timer callback. Either no new entries for a while, so make sure what we've got, including what
+// the log is holding back, is safely in flash, or a config commit has finished and the old slot
+// can go.
+
+{
+    switch (timerNumber)
         {
-            if (!_flush_sector(flushmem))
-                return FALSE;
-            flushmem += NV_BLOCK_LEN;
+            case NV_TIMER_IDLE:
+                logSync();
+                nvSync();
+                break;
+
+            case NV_TIMER_CONFIG:
+                _eraseStaleSlots();
+                break;
+
+            default:
+                ASSERT(FALSE);
+                break;
         }
-    while (flushmem < config_store_page);
+}
+// ============================================================================================
+void nvGetStats(nvStatsType *s)
+
+// Return a copy of the flash activity counters
 
-    return (nvInit());
+{
+    denter_critical();
+    *s=nv_stats;
+    dleave_critical();
 }
 // ============================================================================================
-uint32_t nvGetSpace(void)
+BOOL nvWriteConfig(const ConfigStoreType *c, const ProfileType *profiles)
 
-// Return the amount of free space left
+// Queue the config for writing into the slot not in use. The slot was erased after the last
+// commit, so this is just programming, and the old config stays good until the new one is in.
+// Profiles are carried over from the current config unless new ones are given, which have to
+// stay where they are until the commit is done, as they're written from there.
 
 {
-    return config_store_page-(uint32_t)nv_wp;
+    uint32_t active=_activeSlot();
+    uint32_t target=(active==NV_NO_SLOT)?0:(active+1)%NV_CONFIG_SLOTS;
+
+    // Note what's to go in the new slot. If an earlier commit is still waiting then it's the same
+    // slot, so just update what will be written.
+    nv_cfg=*c;
+    if (profiles)
+        nv_cfg_profiles=profiles;
+    else if ((!nv_cfg_pending) && (active!=NV_NO_SLOT))
+        nv_cfg_profiles=_configSlot(active)->profile;
+    nv_cfg_generation=(active==NV_NO_SLOT)?0:_configSlot(active)->generation+1;
+    if (nv_cfg_generation==NV_EMPTY) nv_cfg_generation=0;
+
+    if (nv_cfg_pending) return TRUE;
+
+    // The erase normally happened in the background, but don't rely on it
+    if ((!_slotBlank(target))
+            && (!_postJob(NV_JOB_ERASE, _slotStart(target), _slotStart(target)+NV_CONFIG_SLOT_LEN, NV_EMPTY)))
+        return FALSE;
+
+    nv_cfg_pending=_postJob(NV_JOB_CONFIG, _slotStart(target), 0, NV_EMPTY);
+    return nv_cfg_pending;
 }
 // ============================================================================================
-BOOL nvWriteConfig(const ConfigStoreType *c)
+BOOL nvReadConfig(ConfigStoreType *c)
 
-// Scrub and re-write the config to nv memory
+// Get configuration from the newest good slot in nv ram (or one waiting to go there) into
+// config buffer
 
 {
-    uint32_t flushmem;                                  // Scratchpad for write location
-    uint32_t ram_block[NV_BLOCK_LEN/sizeof(uint32_t)];  // Scratchpad for transfer mem
-    uint32_t *rp=(uint32_t *)c;                         // Pointer to location in config
-    uint32_t writeRemaining=sizeof(ConfigStoreType);    // Number of bytes to write
-    uint32_t i;
+    uint32_t active=_activeSlot();
 
-    // First erase the old version of the config
-    flushmem = config_store_page;
-    do
+    if (nv_cfg_pending)
         {
-            if (!_flush_sector(flushmem))
-                return FALSE;
-            flushmem += NV_BLOCK_LEN;
+            *c=nv_cfg;
+            return TRUE;
         }
-    while (flushmem < NV_END);
 
-    // Now write the new values back
-    flushmem = config_store_page;
-    while (writeRemaining)
+    if (active==NV_NO_SLOT) return FALSE;
+    *c=_configSlot(active)->c;
+    return TRUE;
+}
+// ============================================================================================
+const ProfileType *nvProfile(uint32_t profileNum)
+
+// Return a profile, read in place from the newest config (or one waiting to go there)
+
+{
+    ASSERT(profileNum<MAX_PROFILES);
+
+    if ((nv_cfg_pending) || (nv_cfg_slot==NV_NO_SLOT))
+        return &nv_cfg_profiles[profileNum];
+    return &_configSlot(nv_cfg_slot)->profile[profileNum];
+}
+// ============================================================================================
+BOOL nvInit(void)
+
+// Initialisation function for non-volatile memory
+
+{
+    uint32_t b=0;
+
+    // Round the first page up to be on a boundary
+    first_free_page=(((uint32_t)NV_STORE_START)+NV_BLOCK_LEN-1)&NV_BLOCK_MASK;
+
+    // Leave room at the top for the config slots
+    config_store_page=NV_END-NV_CONFIG_SLOTS*NV_CONFIG_SLOT_LEN;
+
+    timerInit(&nv_t);
+    timerInit(&nv_cfg_t);
+    // Nothing can be waiting for flash yet
+    nv_qrp=nv_qwp=0;
+    nv_erasePending=0;
+    nv_cfg_pending=FALSE;
+    while (b<NV_QUEUE_BLOCKS) nv_qblockAddr[b++]=NV_EMPTY;
+
+    // Tidy up after a commit that didn't get as far as clearing the old slot
+    nv_cfg_slot=_activeSlot();
+    _scheduleSlotErase();
+    return nvLogInit();
+}
+// ============================================================================================
+nvState nvIteratorState(nvIterator *n)
+
+// Return current state of iterator
+
+{
+    return n->state;
+}
+// ============================================================================================
+// ============================================================================================
+// ============================================================================================
+// Log store held in the spare flash. An external store can be used instead, see nvfram.c
+// ============================================================================================
+// ============================================================================================
+// ============================================================================================
+#ifndef LOG_STORE_FRAM
+// ============================================================================================
+BOOL nvLogInit(void)
+
+// Initialise the log store, finding where we got to last time
+
+{
+    // Work out how many erase units the ring has
+    nv_units=_unitOf(config_store_page-1)+1;
+    ASSERT(nv_units>=3);
+
+    return _locateEnd();
+}
+// ============================================================================================
+BOOL nvMakeRoom(void)
+
+// Do ahead of time the flash work the next entry could need, so nvAppend can then be called with
+// interrupts off without waiting on flash. That's the erase ahead if the last entry started a
+// new unit, and room in the queue for the block the next one goes in.
+
+{
+    if ((bodIsActive()) || (!nv_wp)) return FALSE;
+
+    if ((nv_ahead) && (_prepareAhead())) nv_ahead=FALSE;
+
+    while (!_roomToQueue())
         {
-            i=0;
-            // Copy across the config to write
-            while ((writeRemaining) && (i<(NV_BLOCK_LEN/sizeof(uint32_t))))
+            nv_stats.forced++;
+            if (!_runJob()) return FALSE;
+        }
+
+    // (Re)start the idle countdown for the entry about to go in
+    _idleRestart();
+    return TRUE;
+}
+// ============================================================================================
+BOOL nvAppend(uint32_t val_to_write)
+
+// Add the entry to the write-back block, queueing the block for programming once it's full, but
+// doing no flash work. Called without nvMakeRoom first (as the brownout interrupt does) there
+// might be no room to queue the block, in which case the blocks already waiting are programmed,
+// but nothing's erased.
+
+{
+    BOOL last;
+
+    // Not allowed to write empty values - assert check
+    ASSERT(val_to_write!=NV_EMPTY);
+
+    if (bodIsActive()) return FALSE;
+
+    // If nv isn't available return false
+    if (!nv_wp) return FALSE;
+
+    denter_critical();
+    last=((((uint32_t)nv_wp&(NV_BLOCK_LEN-1))>>2)==NV_BLOCK_WORDS-1);
+    if ((last) && (!_roomToQueue()))
+        {
+            _runPrograms();
+            if (!_roomToQueue())
                 {
-                    writeRemaining-=sizeof(uint32_t);
-                    ram_block[i++]=*rp++;
+                    dleave_critical();
+                    return FALSE;
                 }
+        }
+
+    // Every block starts with a header giving its sequence and the wear on its unit
+    if (!((uint32_t)nv_wp&(NV_BLOCK_LEN-1)))
+        {
+            nv_block[0]=NV_HDR(nv_wear[_unitOf((uint32_t)nv_wp)], nv_seq);
+            nv_seq=(nv_seq+1)%NV_SEQ_LIMIT;
+            nv_wp+=1;
+        }
 
-            // If there's any left-over then scrub the ram
-            while (i<(NV_BLOCK_LEN/sizeof(uint32_t)))
-                ram_block[i++]=0;
+    nv_block[((uint32_t)nv_wp&(NV_BLOCK_LEN-1))>>2]=val_to_write;
+    nv_dirty=TRUE;
+    nv_stats.entries++;
 
-            if (!_write_sector((uint32_t)flushmem, ram_block))
-                return FALSE;
-            flushmem+=NV_BLOCK_LEN;
+    if (last)
+        {
+            // Block is complete, commit it and start afresh on the next one. If that's in a new
+            // unit then room's made ahead of us next time round.
+            _queueBlock();
+            nv_wp+=1;
+            if ((uint32_t)nv_wp>=config_store_page)
+                nv_wp=(uint32_t *)first_free_page;
+            _loadBlock();
+            nv_ahead|=((uint32_t)nv_wp==_unitStart(_unitOf((uint32_t)nv_wp)));
         }
-    while (writeRemaining);
+    else
+        nv_wp+=1;  // Need to move on by four bytes, but these are uint32_t, so thats +1
+    dleave_critical();
     return TRUE;
 }
 // ============================================================================================
-void nvReadConfig(ConfigStoreType *c)
+BOOL nvWrite_entry(uint32_t val_to_write)
 
-// Get configuration from nv ram into config buffer
+// Write value to store, doing any flash work needed first
 
 {
-    uint32_t readRemaining=sizeof(ConfigStoreType);                     // Number of bytes to read
-    uint32_t *readmem = (uint32_t *)(config_store_page);                // Were to get it from
-    uint32_t *writemem = (uint32_t *)c;                                 // Where to write it to
+    return nvMakeRoom() && nvAppend(val_to_write);
+}
+// ============================================================================================
+BOOL nvFlush(void)
 
-    while (readRemaining)
+// Flush the whole of the log memory
+
+{
+    uint32_t unit=_unitOf(nv_tail);
+    uint32_t n=0;
+
+    // Anything waiting to be written is about to be thrown away anyway
+    if (timerRunning(&nv_t)) timerDel(&nv_t);
+    nv_dirty=FALSE;
+
+    // Go oldest first, so if we're stopped part way what's left is still a good ring
+    while (n<nv_units)
         {
-            *writemem++=*readmem++;
-            readRemaining-=sizeof(uint32_t);
+            if ((_header(unit)!=NV_EMPTY) && (!_eraseUnit(unit)))
+                return FALSE;
+            unit=(unit+1)%nv_units;
+            n++;
         }
+
+    // The erases are queued, and reads already see the store as empty, so start again from
+    // the bottom
+    nv_wp=(uint32_t *)first_free_page;
+    nv_tail=first_free_page;
+    _loadBlock();
+    return _prepareAhead();
 }
 // ============================================================================================
-uint32_t nvTotalSpace(void)
+BOOL nvSync(void)
 
-// Return total space in NV memory
+// Queue any part-filled write block for committing to flash
 
 {
-    return (config_store_page-first_free_page);
+    if (bodIsActive()) return FALSE;
+    return _syncBlock();
 }
 // ============================================================================================
-BOOL nvInit(void)
+BOOL nvProgramNow(void)
 
-// Initialisation function for non-volatile memory
+// Program the write-back block and any others waiting straight away, leaving any erases in the
+// queue. For when the power's going and there's only time for what matters.
 
 {
-    uint32_t *rp;
+    BOOL retVal;
 
-    // Round the first page up to be on a boundary
-    first_free_page=(((uint32_t)NV_STORE_START)+NV_BLOCK_LEN-1)&0xFFFFFFC0;
+    if (bodIsActive()) return FALSE;
 
-    // Round down the last free page to make sure there's room for the config
-    config_store_page=((NV_END-sizeof(ConfigStoreType))&0xFFFFFFC0);
+    denter_critical();
+    _runPrograms();
+    retVal=_queueBlock() && _runPrograms();
+    dleave_critical();
+    return retVal;
+}
+// ============================================================================================
+uint32_t _spaceBefore(uint32_t addr)
 
-    rp=(uint32_t *)first_free_page;
+// Return the amount of space left before the data at addr starts to be overwritten. That
+// happens when the writer enters the unit before the one holding it.
 
-    // Loop through NV ram looking for first unused location
-    while ((*rp!=NV_EMPTY) && (rp<(uint32_t *)(config_store_page))) rp++;
+{
+    uint32_t limit=_unitStart((_unitOf(addr)+nv_units-1)%nv_units);
 
-    nv_wp=rp;
-    return ((BOOL)nv_wp<config_store_page);
+    if (limit>=(uint32_t)nv_wp)
+        return limit-(uint32_t)nv_wp;
+    return (config_store_page-(uint32_t)nv_wp)+(limit-first_free_page);
+}
+// ============================================================================================
+uint32_t nvGetSpace(void)
+
+// Return the amount of space left before the oldest data starts to be overwritten
+
+{
+    return _spaceBefore(nv_tail);
+}
+// ============================================================================================
+uint32_t nvSpaceAfter(nvIterator *n)
+
+// Return the amount of space left before the data from an iterator's position onwards starts
+// to be overwritten
+
+{
+    return _spaceBefore((uint32_t)n->rp);
+}
+// ============================================================================================
+uint32_t nvTotalSpace(void)
+
+// Return total space in NV memory
+
+{
+    return (config_store_page-first_free_page);
+}
+// ============================================================================================
+uint32_t nvNumSectors(void)
+
+// Return the number of sectors given over to the log
+
+{
+    return nv_units;
+}
+// ============================================================================================
+uint32_t nvSectorWear(uint32_t sector)
+
+// Return the number of times a log sector has been erased
+
+{
+    return (sector<nv_units)?nv_wear[sector]:0;
 }
 // ============================================================================================
 void nvInitIterator(nvIterator *n)
 
-// Initialise read iterator
+// Initialise read iterator at the oldest data in the store
 
 {
-    n->rp=(uint32_t *)first_free_page;
+    n->rp=(uint32_t *)nv_tail;
     n->state=NV_OK;
 }
 // ============================================================================================
-nvState nvIteratorState(nvIterator *n)
+void nvInitIteratorEnd(nvIterator *n)
 
-// Return current state of iterator
+// Initialise read iterator at the write position, for walking backwards
 
 {
-    return n->state;
+    n->rp=nv_wp;
+    n->state=NV_OK;
 }
 // ============================================================================================
 uint32_t nvIteratorNext(nvIterator *n)
 
-// Get next entry from nv store
+// Get next entry from nv store, stepping over block headers and round the end of the ring
 
 {
-    if ((*n->rp==NV_EMPTY) || ((uint32_t)n->rp>=config_store_page))
+    uint32_t readVal;
+
+    if (n->state!=NV_OK)
+        return NV_EMPTY;
+
+    // An empty header means we've reached the end of what's been written
+    if ((!((uint32_t)n->rp&(NV_BLOCK_LEN-1))) && (_readWord(n->rp++)==NV_EMPTY))
         {
             n->state=NV_ENDSTATE;
             return NV_EMPTY;
         }
 
-    if (n->state==NV_OK)
-        return *n->rp++;
-    else
-        return NV_EMPTY;
+    if ((readVal=_readWord(n->rp))==NV_EMPTY)
+        {
+            n->state=NV_ENDSTATE;
+            return NV_EMPTY;
+        }
+
+    if ((uint32_t)(++n->rp)>=config_store_page)
+        n->rp=(uint32_t *)first_free_page;
+    return readVal;
+}
+// ============================================================================================
+uint32_t nvIteratorPrev(nvIterator *n)
+
+// Get previous entry from nv store, stepping back over block headers and round the ring
+
+{
+    do
+        {
+            if ((n->state!=NV_OK) || ((uint32_t)n->rp==nv_tail)
+                    || ((uint32_t)n->rp==nv_tail+sizeof(uint32_t)))
+                {
+                    n->state=NV_ENDSTATE;
+                    return NV_EMPTY;
+                }
+
+            if ((uint32_t)n->rp==first_free_page)
+                n->rp=(uint32_t *)config_store_page;
+            n->rp--;
+        }
+    while (!((uint32_t)n->rp&(NV_BLOCK_LEN-1)));
+
+    nv_stats.seekReads++;
+    return _readWord(n->rp);
+}
+// ============================================================================================
+uint32_t _blockSeq(uint32_t addr)
+
+// Return the sequence number of the block holding addr, or the one it'll get if it's the next
+// to be started. Anything else is empty, and gives NV_EMPTY.
+
+{
+    uint32_t hdr=_readWord((uint32_t *)(addr&NV_BLOCK_MASK));
+
+    if (hdr!=NV_EMPTY) return NV_HDR_SEQ(hdr);
+    return (addr==(uint32_t)nv_wp)?nv_seq:NV_EMPTY;
 }
 // ============================================================================================
+uint32_t nvCursor(nvIterator *n)
 
+// Return a cursor for the position of an iterator, or for the write position once it's run off
+// the end. It stays good for as long as the data from there on is in the store.
+
+{
+    uint32_t addr=(n->state==NV_OK)?(uint32_t)n->rp:(uint32_t)nv_wp;
+
+    return NV_CURSOR(_blockSeq(addr), addr);
+}
+// ============================================================================================
+BOOL nvGotoCursor(nvIterator *n, uint32_t cursor)
+
+// Set an iterator to the position a cursor was taken at. If the block there has been erased or
+// reused since then the data is gone, and the iterator is left alone.
+
+{
+    uint32_t addr=NV_CURSOR_ADDR(cursor);
+
+    if ((addr<first_free_page) || (addr>=config_store_page) || (NV_CURSOR_SEQ(cursor)!=_blockSeq(addr)))
+        return FALSE;
+
+    n->rp=(uint32_t *)addr;
+    n->state=NV_OK;
+    return TRUE;
+}
+// ============================================================================================
+#endif
@@ -0,0 +1,447 @@
+/*
+ * Log store kept in an external FRAM or EEPROM rather than the spare flash. Selected by defining
+ * LOG_STORE_FRAM in config.h, when it provides the log side of nv.h.
+ *
+ * The device holds a ring of words with NV_EMPTY just after the newest one, which the guard
+ * bit in each log word guarantees can't turn up as data. Nothing needs erasing; once the ring has
+ * wrapped the oldest words are simply written over. The write position is checkpointed into a
+ * header now and again, so at boot only the words written since then need scanning.
+ *
+ * The newest entry is held in RAM until the next one comes along, or the store is synced or goes
+ * idle. That way an entry can be taken with interrupts off without waiting on the device.
+ */
+
+#include <stddef.h>
+#include "config.h"
+#include "dutils.h"
+#include "nv.h"
+#include "fram.h"
+#include "bod.h"
+
+#ifdef LOG_STORE_FRAM
+
+#define NVF_MAGIC        0x464C4F47                         // Marks a formatted device
+#define NVF_CHECKPOINT   256                                // Words between header updates
+
+// Header at the bottom of the device
+typedef struct
+{
+    uint32_t magic;
+    uint32_t wp;                        // Write position when the checkpoint was taken
+    uint32_t wrapped;                   // ...if the ring had gone round by then, in bit 0, over the laps
+    uint32_t crc;                       // Over the rest of the header
+} _nvfHeaderType;
+
+#define NVF_RING_START   sizeof(_nvfHeaderType)
+#define NVF_RING_END     (FRAM_SIZE&~(sizeof(uint32_t)-1))
+
+// A cursor holds the lap a word was written in over its word offset into the ring
+#define NVF_CURSOR(lap,addr) ((((lap)&0xFFFF)<<16)|(((addr)-NVF_RING_START)>>2))
+#define NVF_CURSOR_LAP(x)    ((x)>>16)
+#define NVF_CURSOR_ADDR(x)   (NVF_RING_START+(((x)&0xFFFF)<<2))
+
+// ...so the word offset has to fit in 16 bits
+#if FRAM_SIZE>(0x10000*4)
+#error "FRAM_SIZE too big for a cursor to address"
+#endif
+
+extern nvStatsType nv_stats;            // Counters for store activity, kept in nv.c
+void _idleRestart(void);                // Start the countdown to committing what's waiting, in nv.c
+
+static uint32_t nvf_wp;                 // Device address of the next write, where NV_EMPTY sits
+static BOOL nvf_wrapped;                // Ring has gone round, so the oldest data follows nvf_wp
+static uint32_t nvf_laps;               // Times the ring has gone round or been flushed
+static uint32_t nvf_unsaved;            // Words written since the last checkpoint
+static uint32_t nvf_held;               // Entry waiting to go to the device at nvf_wp...
+static BOOL nvf_holding;                // ...if there is one...
+static BOOL nvf_marked;                 // ...and if its end marker is on the device already
+
+// ============================================================================================
+uint32_t _nvfNext(uint32_t addr)
+
+// Step on a word round the ring
+
+{
+    addr+=sizeof(uint32_t);
+    return (addr>=NVF_RING_END)?NVF_RING_START:addr;
+}
+// ============================================================================================
+uint32_t _nvfEnd(void)
+
+// Return where the end marker will be once the entry waiting has been written
+
+{
+    return nvf_holding?_nvfNext(nvf_wp):nvf_wp;
+}
+// ============================================================================================
+BOOL _nvfWrapping(void)
+
+// Will writing the entry waiting take the ring round?
+
+{
+    return (nvf_holding) && (_nvfNext(nvf_wp)==NVF_RING_START);
+}
+// ============================================================================================
+uint32_t _nvfTail(void)
+
+// Return the device address of the oldest word in the ring
+
+{
+    return ((nvf_wrapped) || (_nvfWrapping()))?_nvfNext(_nvfEnd()):NVF_RING_START;
+}
+// ============================================================================================
+uint32_t _nvfRead(uint32_t addr)
+
+// Read a word from the device, or the entry waiting to go there. If it can't be read it looks
+// empty, which ends any walk.
+
+{
+    uint32_t w;
+
+    if ((nvf_holding) && (addr==nvf_wp)) return nvf_held;
+    return framRead(addr, &w, sizeof(w))?w:NV_EMPTY;
+}
+// ============================================================================================
+BOOL _nvfCheckpoint(void)
+
+// Record the write position in the header
+
+{
+    _nvfHeaderType h;
+
+    h.magic=NVF_MAGIC;
+    h.wp=nvf_wp;
+    h.wrapped=(nvf_laps<<1)|nvf_wrapped;
+    h.crc=dcrc32(0, &h, offsetof(_nvfHeaderType, crc));
+    nvf_unsaved=0;
+    nv_stats.programs++;
+    return framWrite(0, &h, sizeof(h));
+}
+// ============================================================================================
+BOOL _nvfFormat(void)
+
+// Start the ring afresh
+
+{
+    uint32_t e=NV_EMPTY;
+
+    nvf_wp=NVF_RING_START;
+    nvf_wrapped=FALSE;
+    nvf_holding=FALSE;
+    nvf_marked=FALSE;
+    return (framWrite(nvf_wp, &e, sizeof(e)) && _nvfCheckpoint());
+}
+// ============================================================================================
+BOOL _nvfPut(void)
+
+// Write the entry waiting out to the device. The new end marker goes in before it, so there's
+// always one in the ring whenever the writing stops. Interrupts are only held off for each
+// transfer, so the brownout interrupt can come in between and finish the job itself, which
+// is why each step checks it's still needed.
+
+{
+    uint32_t e=NV_EMPTY;
+    BOOL retVal=TRUE;
+
+    framWait();
+    denter_critical();
+    if ((nvf_holding) && (!nvf_marked))
+        {
+            if (framWrite(_nvfNext(nvf_wp), &e, sizeof(e)))
+                nvf_marked=TRUE;
+            else
+                {
+                    nvf_holding=FALSE;
+                    retVal=FALSE;
+                }
+        }
+    dleave_critical();
+
+    framWait();
+    denter_critical();
+    if ((nvf_holding) && (nvf_marked))
+        {
+            if ((retVal=framWrite(nvf_wp, &nvf_held, sizeof(nvf_held))))
+                {
+                    nvf_wp=_nvfNext(nvf_wp);
+                    if (nvf_wp==NVF_RING_START)
+                        {
+                            nvf_wrapped=TRUE;
+                            nvf_laps++;
+                        }
+                    nvf_unsaved++;
+                }
+            nvf_holding=FALSE;
+            nvf_marked=FALSE;
+            nv_stats.programs+=2;
+        }
+    dleave_critical();
+
+    if ((retVal) && (nvf_unsaved>=NVF_CHECKPOINT))
+        return _nvfCheckpoint();
+    return retVal;
+}
+// ============================================================================================
+// ============================================================================================
+// ============================================================================================
+// Externally available routines
+// ============================================================================================
+// ============================================================================================
+// ============================================================================================
+BOOL nvLogInit(void)
+
+// Initialise the log store, finding where we got to last time
+
+{
+    _nvfHeaderType h;
+    uint32_t n=0;
+
+    if (!framInit()) return FALSE;
+
+    // Without a good header nothing on the device can be trusted, so start again
+    if ((!framRead(0, &h, sizeof(h))) || (h.magic!=NVF_MAGIC)
+            || (h.crc!=dcrc32(0, &h, offsetof(_nvfHeaderType, crc)))
+            || (h.wp<NVF_RING_START) || (h.wp>=NVF_RING_END) || (h.wp&(sizeof(uint32_t)-1)))
+        return _nvfFormat();
+
+    // Anything written since the checkpoint runs from there up to the end marker
+    nvf_wp=h.wp;
+    nvf_holding=FALSE;
+    nvf_marked=FALSE;
+    nvf_wrapped=h.wrapped&1;
+    nvf_laps=h.wrapped>>1;
+    while (_nvfRead(nvf_wp)!=NV_EMPTY)
+        {
+            nv_stats.seekReads++;
+            nvf_wp=_nvfNext(nvf_wp);
+            if (nvf_wp==NVF_RING_START)
+                {
+                    nvf_wrapped=TRUE;
+                    nvf_laps++;
+                }
+
+            // No end marker anywhere, so it's not a ring we made
+            if (++n>=(NVF_RING_END-NVF_RING_START)/sizeof(uint32_t))
+                return _nvfFormat();
+        }
+
+    nvf_unsaved=n;
+    return TRUE;
+}
+// ============================================================================================
+BOOL nvMakeRoom(void)
+
+// Write out the entry waiting, so nvAppend can then be called with interrupts off without
+// waiting on the device
+
+{
+    if ((bodIsActive()) || (!_nvfPut())) return FALSE;
+
+    // (Re)start the idle countdown for the entry about to go in
+    _idleRestart();
+    return TRUE;
+}
+// ============================================================================================
+BOOL nvWrite_entry(uint32_t val_to_write)
+
+// Write value to store
+
+{
+    return nvMakeRoom() && nvAppend(val_to_write);
+}
+// ============================================================================================
+BOOL nvAppend(uint32_t val_to_write)
+
+// Hold value to go to the device, but check it's not NV_EMPTY (0xFFFFFFFF) first. Called without
+// nvMakeRoom first (as the brownout interrupt does) the entry already waiting is written out
+// here.
+
+{
+    BOOL retVal;
+
+    // Not allowed to write empty values - assert check
+    ASSERT(val_to_write!=NV_EMPTY);
+
+    if (bodIsActive()) return FALSE;
+
+    denter_critical();
+    retVal=(!nvf_holding) || (_nvfPut());
+    nvf_held=val_to_write;
+    nvf_holding=TRUE;
+    nv_stats.entries++;
+    dleave_critical();
+    return retVal;
+}
+// ============================================================================================
+BOOL nvFlush(void)
+
+// Flush the whole of the log memory. There's nothing to erase, so this is quick. It counts as
+// a lap, so cursors from before don't match what gets written next.
+
+{
+    nvf_laps++;
+    return _nvfFormat();
+}
+// ============================================================================================
+BOOL nvSync(void)
+
+// Write out the entry waiting and bring the checkpoint up to date
+
+{
+    if ((bodIsActive()) || (!_nvfPut())) return FALSE;
+    return (nvf_unsaved)?_nvfCheckpoint():TRUE;
+}
+// ============================================================================================
+BOOL nvProgramNow(void)
+
+// There's nothing to erase, so this is just a sync
+
+{
+    return nvSync();
+}
+// ============================================================================================
+uint32_t nvGetSpace(void)
+
+// Return the amount of space left before the oldest data starts to be overwritten
+
+{
+    return ((nvf_wrapped) || (_nvfWrapping()))?0:NVF_RING_END-_nvfEnd()-sizeof(uint32_t);
+}
+// ============================================================================================
+uint32_t nvSpaceAfter(nvIterator *n)
+
+// Return the amount of space left before the data from an iterator's position onwards starts
+// to be overwritten. The word before it is as far as the end marker can go.
+
+{
+    uint32_t addr=(uint32_t)n->rp;
+    uint32_t end=_nvfEnd();
+
+    if (addr>end)
+        return addr-end-sizeof(uint32_t);
+    return (NVF_RING_END-end)+(addr-NVF_RING_START)-sizeof(uint32_t);
+}
+// ============================================================================================
+uint32_t nvTotalSpace(void)
+
+// Return total space in the store
+
+{
+    return NVF_RING_END-NVF_RING_START;
+}
+// ============================================================================================
+uint32_t nvNumSectors(void)
+
+// Return the number of sectors given over to the log. There are none to wear out here.
+
+{
+    return 0;
+}
+// ============================================================================================
+uint32_t nvSectorWear(uint32_t sector)
+
+// Return the number of times a log sector has been erased
+
+{
+    (void)sector;
+    return 0;
+}
+// ============================================================================================
+void nvInitIterator(nvIterator *n)
+
+// Initialise read iterator at the oldest data in the store
+
+{
+    n->rp=(uint32_t *)_nvfTail();
+    n->state=NV_OK;
+}
+// ============================================================================================
+void nvInitIteratorEnd(nvIterator *n)
+
+// Initialise read iterator at the write position, for walking backwards
+
+{
+    n->rp=(uint32_t *)_nvfEnd();
+    n->state=NV_OK;
+}
+// ============================================================================================
+uint32_t nvIteratorNext(nvIterator *n)
+
+// Get next entry from nv store, round the end of the ring
+
+{
+    uint32_t readVal;
+
+    if (n->state!=NV_OK)
+        return NV_EMPTY;
+
+    if (((uint32_t)n->rp==_nvfEnd()) || ((readVal=_nvfRead((uint32_t)n->rp))==NV_EMPTY))
+        {
+            n->state=NV_ENDSTATE;
+            return NV_EMPTY;
+        }
+
+    n->rp=(uint32_t *)_nvfNext((uint32_t)n->rp);
+    return readVal;
+}
+// ============================================================================================
+uint32_t nvIteratorPrev(nvIterator *n)
+
+// Get previous entry from nv store, round the ring
+
+{
+    uint32_t addr=(uint32_t)n->rp;
+
+    if ((n->state!=NV_OK) || (addr==_nvfTail()))
+        {
+            n->state=NV_ENDSTATE;
+            return NV_EMPTY;
+        }
+
+    addr=((addr==NVF_RING_START)?NVF_RING_END:addr)-sizeof(uint32_t);
+    n->rp=(uint32_t *)addr;
+    nv_stats.seekReads++;
+    return _nvfRead(addr);
+}
+// ============================================================================================
+uint32_t _nvfLap(uint32_t addr)
+
+// Return the lap the word at addr was written in, or will be if it's the next to be written.
+// Past the write position that's the lap before, if the ring has been round at all.
+
+{
+    uint32_t laps=nvf_laps+_nvfWrapping();
+
+    if (addr<=_nvfEnd()) return laps;
+    return ((nvf_wrapped) || (_nvfWrapping()))?laps-1:NV_EMPTY;
+}
+// ============================================================================================
+uint32_t nvCursor(nvIterator *n)
+
+// Return a cursor for the position of an iterator, or for the write position once it's run off
+// the end. It stays good for as long as the data from there on is in the store.
+
+{
+    uint32_t addr=(n->state==NV_OK)?(uint32_t)n->rp:_nvfEnd();
+
+    return NVF_CURSOR(_nvfLap(addr), addr);
+}
+// ============================================================================================
+BOOL nvGotoCursor(nvIterator *n, uint32_t cursor)
+
+// Set an iterator to the position a cursor was taken at. If that's been written over or flushed
+// since then the data is gone, and the iterator is left alone.
+
+{
+    uint32_t addr=NVF_CURSOR_ADDR(cursor);
+    uint32_t lap=_nvfLap(addr);
+
+    if ((addr>=NVF_RING_END) || (lap==NV_EMPTY) || ((lap&0xFFFF)!=NVF_CURSOR_LAP(cursor)))
+        return FALSE;
+
+    n->rp=(uint32_t *)addr;
+    n->state=NV_OK;
+    return TRUE;
+}
+// ============================================================================================
+#endif
@@ -91,6 +91,7 @@ int32_t pidCalc(pidInstanceType *p, int32_t pvSet)
     if (_dabs(p->integral) > p->integralLimit) p->integral = _dsign(p->integral)*p->integralLimit;
 
     derivative = (p->Cd*(p->prevPv-pvSet))/p->interval;
+    p->derivative=derivative;
     p->prevPv=pvSet;
 
     p->output = p->bias + p->Cp*error + ((p->integral*p->interval)/p->Ci) + derivative;
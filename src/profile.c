@@ -1,6 +1,6 @@
 /*
  * Execute a stored temperature profile. The profiles themselves are defined externally and are kept
- * in the sysConfig structure.
+ * alongside the config in nv ram, where they're read in place through nvProfile.
  */
 
 #include "timers.h"
@@ -9,6 +9,7 @@
 #include "printf.h"
 #include "heater.h"
 #include "log.h"
+#include "nv.h"
 
 typedef struct
 
@@ -48,7 +49,7 @@ void _nextStep(void)
     char constructString[300];      // Construction string for output
 
     // Step tag
-    sprintf(constructString,"[%s %d/%d] ", sysConfig.profile[_condition.profile].name,
+    sprintf(constructString,"[%s %d/%d] ", nvProfile(_condition.profile)->name,
             _condition.profile + 1, _condition.stepNumber+1);
 
     if (_condition.stepNumber >= MAX_PROFILE_STEPS)
@@ -62,19 +63,19 @@ void _nextStep(void)
         {
             // Another step, so label the step type
             sprintf(constructString,"%s%s ",constructString,
-                    _stepnames[(sysConfig.profile[_condition.profile].step[_condition.stepNumber].command &
+                    _stepnames[(nvProfile(_condition.profile)->step[_condition.stepNumber].command &
                                 PROFILE_COMMAND_MASK)>>28]);
 
-            switch (sysConfig.profile[_condition.profile].step[_condition.stepNumber].command &
+            switch (nvProfile(_condition.profile)->step[_condition.stepNumber].command &
                     PROFILE_COMMAND_MASK)
                 {
                         // -----------------
                     case PROFILE_FOREVER:
                         // We are just doing to stay in this state until actively stopped
                         stateChangeSetpoint(
-                            sysConfig.profile[_condition.profile].step[_condition.stepNumber].temp&PROFILE_TEMP_MASK);
+                            nvProfile(_condition.profile)->step[_condition.stepNumber].temp&PROFILE_TEMP_MASK);
                         sprintf(constructString,"%sFOREVER stay at %d°C",constructString,
-                                (sysConfig.profile[_condition.profile].step[_condition.stepNumber].temp)&PROFILE_TEMP_MASK /
+                                (nvProfile(_condition.profile)->step[_condition.stepNumber].temp)&PROFILE_TEMP_MASK /
                                 DEGREE);
                         break;
 
@@ -82,14 +83,14 @@ void _nextStep(void)
                     case PROFILE_JUMP:
                         // We are going to move to another profile
                         sprintf(constructString,"%sJUMP request to profile %d",constructString,
-                                sysConfig.profile[_condition.profile].step[_condition.stepNumber].otherProfile);
-                        if (sysConfig.profile[_condition.profile].step[_condition.stepNumber].otherProfile < MAX_PROFILES)
+                                nvProfile(_condition.profile)->step[_condition.stepNumber].otherProfile);
+                        if (nvProfile(_condition.profile)->step[_condition.stepNumber].otherProfile < MAX_PROFILES)
                             {
-                                _condition.totalRuntime += sysConfig.profile[_condition.profile].step[_condition.stepNumber].time;
+                                _condition.totalRuntime += nvProfile(_condition.profile)->step[_condition.stepNumber].time;
                                 // Pretty up the printing if after the first step
                                 if (_condition.traceOn)
                                     commandReportLine("%s\n",constructString);
-                                profileRun(sysConfig.profile[_condition.profile].step[_condition.stepNumber].otherProfile);
+                                profileRun(nvProfile(_condition.profile)->step[_condition.stepNumber].otherProfile);
                                 return;
                             }
                         else
@@ -109,23 +110,23 @@ void _nextStep(void)
                         _condition.totalRuntime -= _condition.remainingStepTime;
 
                         sprintf(constructString,"%s %d°C in %d seconds (%d seconds elapsed)",constructString,
-                                ((sysConfig.profile[_condition.profile].step[_condition.stepNumber].temp)&PROFILE_TEMP_MASK) /
+                                ((nvProfile(_condition.profile)->step[_condition.stepNumber].temp)&PROFILE_TEMP_MASK) /
                                 DEGREE,
-                                (sysConfig.profile[_condition.profile].step[_condition.stepNumber].time) / mS,
+                                (nvProfile(_condition.profile)->step[_condition.stepNumber].time) / mS,
                                 _condition.totalRuntime / mS);
 
                         // Now prepare the next step....
                         _condition.remainingStepTime =
-                            sysConfig.profile[_condition.profile].step[_condition.stepNumber].time;
-                        _condition.stepType = sysConfig.profile[_condition.profile].step[_condition.stepNumber].command &
+                            nvProfile(_condition.profile)->step[_condition.stepNumber].time;
+                        _condition.stepType = nvProfile(_condition.profile)->step[_condition.stepNumber].command &
                                               PROFILE_COMMAND_MASK;
 
                         // Store the intended final temperature for this step
                         _condition.intendedFinal =
-                            sysConfig.profile[_condition.profile].step[_condition.stepNumber].temp&PROFILE_TEMP_MASK;
+                            nvProfile(_condition.profile)->step[_condition.stepNumber].temp&PROFILE_TEMP_MASK;
 
                         // And increment either TEMP or TIME depending on step type
-                        if ((sysConfig.profile[_condition.profile].step[_condition.stepNumber].command &
+                        if ((nvProfile(_condition.profile)->step[_condition.stepNumber].command &
                                 PROFILE_COMMAND_MASK) == PROFILE_REACHTEMP)
                             {
                                 // This is just a reach-temp-as-quickly-as-possible step
@@ -157,7 +158,7 @@ void _nextStep(void)
         }
 
     // Assume we will run for the whole period - if it's different it'll be fixed up at the end of the period
-    _condition.totalRuntime += sysConfig.profile[_condition.profile].step[_condition.stepNumber].time;
+    _condition.totalRuntime += nvProfile(_condition.profile)->step[_condition.stepNumber].time;
 
 
     // All done - tidy and print
@@ -234,6 +235,7 @@ BOOL profileRun(uint32_t profileNum)
     _condition.state = ProfileStateRunning;
 
     logNewLog();
+    logSetProfile(profileNum);
     _nextStep();
     return TRUE;
 }
@@ -0,0 +1,201 @@
+/*
+ * Flight recorder for the PID loop. Each iteration goes into a RAM ring, oldest overwritten, so
+ * the lead up to any problem is there at full rate without wearing the flash. When something
+ * notable happens the ring is frozen, then written to the log as a single block record once
+ * that's possible, after which recording starts again. When the power's going it's written
+ * straight away, in with the brownout mark.
+ *
+ * Each iteration is packed into RECORDER_FRAME_WORDS words of two 15 bit signed fields, so it
+ * can go into the log as it is.
+ */
+
+#include "config.h"
+#include "recorder.h"
+#include "log.h"
+#include "bod.h"
+
+#define RECORDER_FIELD_BITS  15
+#define RECORDER_FIELD_MAX   ((1<<(RECORDER_FIELD_BITS-1))-1)
+#define RECORDER_FIELD_MASK  ((1<<RECORDER_FIELD_BITS)-1)
+
+static uint32_t ring[RECORDER_FRAMES*RECORDER_FRAME_WORDS];     // The iterations, packed...
+static uint32_t nextFrame;              // ...where the next one goes...
+static uint32_t numFrames;              // ...and how many there are
+static volatile BOOL frozen;            // Waiting to be logged, so nothing more is recorded...
+static volatile uint32_t frozenReason;  // ...and why...
+static volatile BOOL writing;           // ...or being written by recorderService
+static BOOL overshootArmed;             // Been at or below the setpoint since the last overshoot
+static int32_t lastSetPoint;
+
+static const char *reasonNames[]= { RECORDERNAMES };
+
+// ============================================================================================
+uint32_t _pair(int32_t a, int32_t b)
+
+// Pack two values into a word, limiting them to what will fit
+
+{
+    if (a>RECORDER_FIELD_MAX) a=RECORDER_FIELD_MAX;
+    if (a<-RECORDER_FIELD_MAX) a=-RECORDER_FIELD_MAX;
+    if (b>RECORDER_FIELD_MAX) b=RECORDER_FIELD_MAX;
+    if (b<-RECORDER_FIELD_MAX) b=-RECORDER_FIELD_MAX;
+
+    return (a&RECORDER_FIELD_MASK)|((b&RECORDER_FIELD_MASK)<<RECORDER_FIELD_BITS);
+}
+// ============================================================================================
+int32_t _field(uint32_t w, uint32_t n)
+
+// Unpack field n of a word, extending the sign
+
+{
+    return ((int32_t)(w<<(32-RECORDER_FIELD_BITS*(n+1))))>>(32-RECORDER_FIELD_BITS);
+}
+// ============================================================================================
+void _reverseWords(uint32_t *w, uint32_t len)
+
+// Reverse the order of len words
+
+{
+    uint32_t t;
+    uint32_t i=0;
+
+    while (i<len/2)
+        {
+            t=w[i];
+            w[i]=w[len-1-i];
+            w[len-1-i]=t;
+            i++;
+        }
+}
+// ============================================================================================
+uint32_t _inOrder(void)
+
+// Put the ring in order, oldest first, by rotating it round to start at the oldest, and return
+// the number of words in it
+
+{
+    if (numFrames==RECORDER_FRAMES)
+        {
+            _reverseWords(ring, nextFrame*RECORDER_FRAME_WORDS);
+            _reverseWords(&ring[nextFrame*RECORDER_FRAME_WORDS], (RECORDER_FRAMES-nextFrame)*RECORDER_FRAME_WORDS);
+            _reverseWords(ring, RECORDER_FRAMES*RECORDER_FRAME_WORDS);
+        }
+    return numFrames*RECORDER_FRAME_WORDS;
+}
+// ============================================================================================
+// ============================================================================================
+// ============================================================================================
+// Externally available routines
+// ============================================================================================
+// ============================================================================================
+// ============================================================================================
+void recorderAdd(int32_t pv, pidInstanceType *p)
+
+// Record an iteration of the PID loop, and check it for overshoot
+
+{
+    uint32_t *f=&ring[nextFrame*RECORDER_FRAME_WORDS];
+
+    if (frozen) return;
+
+    f[0]=_pair(pv, p->setPoint);
+    f[1]=_pair(p->prevError, p->integral);
+    f[2]=_pair(p->derivative, p->output);
+    nextFrame=(nextFrame+1)%RECORDER_FRAMES;
+    if (numFrames<RECORDER_FRAMES) numFrames++;
+
+    // Only going past the setpoint on the way up counts, not it being turned down underneath us
+    if (p->setPoint<lastSetPoint) overshootArmed=FALSE;
+    lastSetPoint=p->setPoint;
+
+    if (pv<=p->setPoint)
+        overshootArmed=TRUE;
+    else if ((overshootArmed) && (pv>p->setPoint+RECORDER_OVERSHOOT_LIMIT))
+        {
+            overshootArmed=FALSE;
+            recorderTrigger(RECORDER_OVERSHOOT);
+        }
+}
+// ============================================================================================
+void recorderTrigger(recorderReasonType reason)
+
+// Freeze the recording, to be logged when possible. Safe to call from an interrupt. If it's
+// already frozen then the first reason stands.
+
+{
+    if (frozen) return;
+    frozenReason=reason;
+    frozen=TRUE;
+}
+// ============================================================================================
+void recorderService(void)
+
+// Log the recording if it's frozen and the store can be written
+
+{
+    uint32_t count;
+
+    if ((!frozen) || (bodIsActive())) return;
+
+    // If the power goes while this is going on the brownout won't take the ring as well
+    writing=TRUE;
+    if ((count=_inOrder())) logWriteBlock(LOG_PID_TRACE, frozenReason, ring, count);
+
+    nextFrame=numFrames=0;
+    frozen=FALSE;
+    writing=FALSE;
+}
+// ============================================================================================
+uint32_t recorderTake(recorderReasonType reason, uint32_t *frozenFor, const uint32_t **words)
+
+// Freeze the recording for reason, unless it's frozen already, and hand it over to be logged now
+// instead of by recorderService. Returns the number of words, oldest first, with why it was
+// frozen. For the brownout interrupt, so there's nothing if recorderService is writing it.
+
+{
+    uint32_t count;
+
+    recorderTrigger(reason);
+    if (writing) return 0;
+
+    *frozenFor=frozenReason;
+    *words=ring;
+    count=_inOrder();
+    nextFrame=numFrames=0;
+    frozen=FALSE;
+    return count;
+}
+// ============================================================================================
+void recorderDecode(const uint32_t *words, recorderFrameType *f)
+
+// Unpack an iteration read back from the log
+
+{
+    f->pv=_field(words[0], 0);
+    f->setPoint=_field(words[0], 1);
+    f->error=_field(words[1], 0);
+    f->integral=_field(words[1], 1);
+    f->derivative=_field(words[2], 0);
+    f->output=_field(words[2], 1);
+}
+// ============================================================================================
+const char *recorderReasonName(uint32_t reason)
+
+// Return the name of a reason for freezing
+
+{
+    return (reason<sizeof(reasonNames)/sizeof(reasonNames[0]))?reasonNames[reason]:"Unknown";
+}
+// ============================================================================================
+void recorderInit(void)
+
+// Initialise the recorder
+
+{
+    nextFrame=numFrames=0;
+    frozen=FALSE;
+    writing=FALSE;
+    overshootArmed=FALSE;
+    lastSetPoint=0;
+}
+// ============================================================================================
@@ -20,9 +20,7 @@
 #include "pid.h"
 #include "gpio.h"
 #include "ledflash.h"
-
-// Cycle time when heater is on
-#define CYCLE_LEN       1000
+#include "recorder.h"
 
 #define LED_FLASH_TIME                    50    // Time in MS for LED to flash while collecting sample
 #define LED_ERROR_FLASH_TIME             150    // Time in MS for LED to flash under error condition
@@ -31,46 +29,146 @@ static pidInstanceType pidInstance;             // The PID control instance
 static BOOL isErrored;                          // Is the heater currently in a error state?
 static timerType tstate;                        // Timer for this state machine
 
+// ============================================================================================
+// Spread of readings over a record interval. Each is added in weighted by the mS it was held for,
+// so only multiplies are needed per reading and the division is left to the end of the interval.
+typedef struct
+{
+    uint64_t sum;           // Readings times their weights...
+    uint64_t sumSquares;    // ...and their squares
+    uint32_t min;           // Lowest reading...
+    uint32_t max;           // ...and highest
+} _aggregateType;
+
+// ============================================================================================
+static void _aggregateReset(_aggregateType *a)
+
+// Start a new interval
+
+{
+    a->sum = 0;
+    a->sumSquares = 0;
+    a->min = 0xFFFFFFFF;
+    a->max = 0;
+}
+// ============================================================================================
+static void _aggregateAdd(_aggregateType *a, uint32_t reading, uint32_t weight)
+
+// Add a reading held for weight mS
+
+{
+    if (!weight) return;
+
+    a->sum += (uint64_t)reading * weight;
+    a->sumSquares += (uint64_t)reading * reading * weight;
+    if (reading < a->min) a->min = reading;
+    if (reading > a->max) a->max = reading;
+}
+// ============================================================================================
+static uint32_t _aggregateSpread(_aggregateType *a, uint32_t mean, uint32_t total)
+
+// Return the standard deviation of the readings over total mS, given their mean. The sum of the
+// squares of the differences from the mean is worked out from the sums, all in 64 bits.
+
+{
+    int64_t squares = a->sumSquares - 2 * (uint64_t)mean * a->sum + (uint64_t)mean * mean * total;
+    uint32_t variance = (squares > 0) ? squares / total : 0;
+    uint32_t root = 0, bit = 1 << 30;
+
+    // Square root a bit at a time
+    while (bit > variance)
+        bit >>= 2;
+    while (bit)
+        {
+            if (variance >= root + bit)
+                {
+                    variance -= root + bit;
+                    root = (root >> 1) + bit;
+                }
+            else
+                root >>= 1;
+            bit >>= 2;
+        }
+    return root;
+}
+// ============================================================================================
+static BOOL _moved(uint32_t value, uint32_t last, uint32_t tolerance)
+
+// Return TRUE if value is further than tolerance from the last one logged
+
+{
+    return (value > last + tolerance) || (value + tolerance < last);
+}
 // ============================================================================================
 void contribute_log_entry(uint32_t temperature_set, uint32_t onproportion_set,
                           uint32_t setpoint_set, uint32_t time_tick)
 
 // Add part of an entry for logging - we don't log as often as we refresh the sample, so
 // the purpose of this routine is to average the readings and write them at the logging interval.
+// Once a log gets long the interval is stretched so it still fits, except for a while after the
+// setpoint changes. The lowest and highest temperatures and outputs, and their spreads, are
+// written with each average when they're far enough from it to matter and are selected to be
+// logged. Average temperatures that have barely moved are logged as they were, so a steady hold
+// goes in as runs of the same temperature. Time is in mS throughout.
 
 {
-    static uint32_t acc_temp = 0, acc_onprop = 0, acc_time = 0, acc_setpoint = 0;
-    static uint32_t old_onprop = 0, old_setpoint = 0;
-    uint32_t time_part;
+    static _aggregateType temp = { 0, 0, 0xFFFFFFFF, 0 }, onprop = { 0, 0, 0xFFFFFFFF, 0 };
+    static uint64_t acc_setpoint = 0;
+    static uint32_t acc_time = 0;
+    static uint32_t old_onprop = 0, old_setpoint = 0, old_temp = 0;
+    static uint32_t interval = 0, old_interval = 0, last_setpoint = 0, fine_left = 0;
+    uint32_t time_part, thin, avg_temp, avg_onprop;
+
+    // A change of setpoint cuts a stretched interval short, so the readings after it are kept
+    if (setpoint_set != last_setpoint)
+        {
+            last_setpoint = setpoint_set;
+            fine_left = LOG_FINE_WINDOW;
+            if ((acc_time) && (interval > sysConfig.recordInterval)) interval = acc_time;
+        }
 
-    // Only work in integer seconds, to keep sizes under control
-    time_tick/=mS;
-    acc_time += time_tick;          // Time is in integer seconds
+    // Each interval is as long as the space left for this log allows
+    if (!acc_time)
+        {
+            interval = sysConfig.recordInterval;
+            thin = (fine_left) ? 0 : logThinning();
+            while ((thin--) && (interval * 2 <= LOG_MAX_INTERVAL))
+                interval *= 2;
+        }
+    fine_left = (fine_left > time_tick) ? fine_left - time_tick : 0;
+
+    acc_time += time_tick;
 
-    if (acc_time >= sysConfig.recordInterval)
+    if (acc_time >= interval)
         {
             // It's time to write some data
-            time_part = (sysConfig.recordInterval) - (acc_time - time_tick);
+            time_part = interval - (acc_time - time_tick);
         }
     else
         time_part = time_tick;
 
     // Accumulate variables ....
-    acc_temp += temperature_set * time_part;
-    acc_onprop += onproportion_set * time_part;
-    acc_setpoint += setpoint_set * time_part;
+    _aggregateAdd(&temp, temperature_set, time_part);
+    _aggregateAdd(&onprop, onproportion_set, time_part);
+    acc_setpoint += (uint64_t)setpoint_set * time_part;
 
-    if (acc_time >= sysConfig.recordInterval)
+    if (acc_time >= interval)
         {
-            acc_onprop/=acc_time;
-            acc_temp/=acc_time;
-            acc_setpoint/=acc_time;
+            avg_onprop = onprop.sum / interval;
+            avg_temp = temp.sum / interval;
+            acc_setpoint /= interval;
 
             // Write the average for this period of time
-            if (old_onprop != acc_onprop)
+            if (old_interval != interval)
+                {
+                    logWrite(LOG_RECORD_INTERVAL, interval);
+                    old_interval = interval;
+                }
+
+            if (old_onprop != avg_onprop)
                 {
-                    logWrite(LOG_ON_PERCENTAGE, acc_onprop);
-                    old_onprop = acc_onprop;
+                    logWrite(LOG_ON_PERCENTAGE, avg_onprop);
+                    old_onprop = avg_onprop;
                 }
 
             if (old_setpoint != acc_setpoint)
@@ -79,12 +177,27 @@ void contribute_log_entry(uint32_t temperature_set, uint32_t onproportion_set,
                     old_setpoint = acc_setpoint;
                 }
 
+            // What the averages hide
+            if (avg_onprop - onprop.min > LOG_OUTPUT_TOLERANCE)
+                logWrite(LOG_ON_PERCENTAGE_MIN, onprop.min);
+            if (onprop.max - avg_onprop > LOG_OUTPUT_TOLERANCE)
+                logWrite(LOG_ON_PERCENTAGE_MAX, onprop.max);
+            if (onprop.max - onprop.min > LOG_OUTPUT_TOLERANCE)
+                logWrite(LOG_ON_PERCENTAGE_SPREAD, _aggregateSpread(&onprop, avg_onprop, interval));
+            if (avg_temp - temp.min > LOG_RANGE_TOLERANCE)
+                logWrite(LOG_TEMPERATURE_MIN, temp.min);
+            if (temp.max - avg_temp > LOG_RANGE_TOLERANCE)
+                logWrite(LOG_TEMPERATURE_MAX, temp.max);
+            if (temp.max - temp.min > LOG_RANGE_TOLERANCE)
+                logWrite(LOG_TEMPERATURE_SPREAD, _aggregateSpread(&temp, avg_temp, interval));
+
             // We make sure temperature is written last as it simplifies reconstruction
-            logWrite(LOG_TEMPERATURE, acc_temp);
+            if (_moved(avg_temp, old_temp, LOG_STEADY_TEMPERATURE)) old_temp = avg_temp;
+            logWrite(LOG_TEMPERATURE, old_temp);
 
             // Zero the variables
-            acc_temp = 0;
-            acc_onprop = 0;
+            _aggregateReset(&temp);
+            _aggregateReset(&onprop);
             acc_time = 0;
             acc_setpoint = 0;
 
@@ -99,6 +212,9 @@ void _getReading(void)
 {
     uint32_t temperature, output;
 
+    // Get any recording that's been frozen since last time into the log
+    recorderService();
+
     // See if we have got a valid temperature
     temperature = sensorReturnReading();
 
@@ -107,17 +223,22 @@ void _getReading(void)
         {
             ledSetState(LEDFLASH_ERROR);
             heaterSetLevel(0, CYCLE_LEN);
+            if (!isErrored) recorderTrigger(RECORDER_SENSOR_FAULT);
             isErrored=TRUE;
             sensorRequestCallback();    // Get another reading as soon as we can
             return;
         }
 
     ledSetState(LEDFLASH_NORMAL);
+    isErrored=FALSE;
     // ...otherwise we've got a valid temp, so do the business with it
     if (pidGetSetpoint(&pidInstance) == SETPOINT_IDLE)
         output = 0;
     else
-        output=pidCalc(&pidInstance,temperature);
+        {
+            output=pidCalc(&pidInstance,temperature);
+            recorderAdd(temperature, &pidInstance);
+        }
 
     heaterSetLevel(output, CYCLE_LEN);
     contribute_log_entry(temperature, heaterGetPercentage(), pidGetSetpoint(&pidInstance), CYCLE_LEN);
@@ -23,6 +23,7 @@
 #include "command.h"
 #include "sensor.h"
 #include "ledflash.h"
+#include "nv.h"
 
 // WKT timer runs at 750KHz, and we want 1mS resolution timers
 #define TICKS_PER_MS 750
@@ -45,6 +46,22 @@ static timerType *timerHead;
 // Time to the next timer to mature
 static volatile uint32_t _nextTO;
 
+// Free running microseconds up to the last counter reload, and the counts left over from it
+static volatile uint32_t _micros;
+static volatile uint32_t _microCounts;
+
+// ============================================================================================
+void _soakMicros(uint32_t counts)
+
+// Add counter ticks to the microsecond count, carrying the part microsecond into the next period
+// Called with interrupts off
+
+{
+    counts+=_microCounts;
+    _micros+=(counts/3)*4;                      // Counter runs at 0.75 ticks per uS
+    _microCounts=counts%3;
+}
+
 // ============================================================================================
 void WKT_IRQHandler(void)
 
@@ -58,6 +75,7 @@ void WKT_IRQHandler(void)
 
     // ...now account for this time
     _ticks+=_nextTO/TICKS_PER_MS; // Soak up the ticks from this timer maturation
+    _soakMicros(_nextTO);
     _nextTO=MAX_TIMEOUT;
 
     flag_post(FLAG_TICK);         // Let the base layer know something has to happen
@@ -78,10 +96,16 @@ void _setTimeout(void)
     LPC_WKT->CTRL=WKT_CLEAR;
 
     if (currentReading<=_nextTO)
-        _ticks+=(_nextTO-currentReading)/TICKS_PER_MS;
+        {
+            _ticks+=(_nextTO-currentReading)/TICKS_PER_MS;
+            _soakMicros(_nextTO-currentReading);
+        }
     else
-        // This is just in case we wrapped around
-        _ticks+=_nextTO/TICKS_PER_MS;
+        {
+            // This is just in case we wrapped around
+            _ticks+=_nextTO/TICKS_PER_MS;
+            _soakMicros(_nextTO);
+        }
 
     // Now find the time for the next one to mature - be aware the interval timer is still running here
     if (timerHead)
@@ -285,6 +309,24 @@ uint32_t timerSecs(void)
     return ((_weeks*TICKS_PER_WEEK)/mS) + (_getTicks()/mS);
 }
 // ============================================================================================
+uint32_t timerMicros(void)
+
+// Get a free running count of microseconds for timing short intervals. It wraps, so only the
+// difference between two readings means anything. It is kept apart from _ticks, which drops
+// the part millisecond at each reload and is wound back weekly, so it never steps backwards.
+
+{
+    uint32_t val;
+    denter_critical();
+
+    while ((val=LPC_WKT->COUNT) != LPC_WKT->COUNT);
+    val=_microCounts+(_nextTO-val);
+    val=_micros+(val/3)*4+((val%3)*4)/3;        // Counter runs at 0.75 ticks per uS
+
+    dleave_critical();
+    return val;
+}
+// ============================================================================================
 void timerDispatch(void)
 
 // Dispatch a timer that has matured
@@ -350,6 +392,10 @@ void timerDispatch(void)
                         sensorTimeout();
                         break;
 
+                    case TIMER_ORIGIN_NV:
+                        nvTimeout(maturedTimerNumber);
+                        break;
+
                     default:
                         ASSERT(FALSE);
                         ;